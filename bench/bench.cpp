@@ -0,0 +1,603 @@
+/* Benchmark harness for rs-cache-finder-linux.
+ *
+ * Builds a synthetic directory tree, with a chosen share of its file and
+ * directory names matching the cache tables, then times each stage of a run
+ * on its own: pattern matching, scanning the tree, and writing the matched
+ * files to a tarball.  Scanning and archiving are timed with the page cache
+ * both warm and, where the kernel lets us empty it, cold.  Results are
+ * written as JSON so that runs of different versions can be compared.
+ *
+ * Build and run with "make bench".  The tree is generated from a fixed seed,
+ * so the same parameters always give the same tree, and it is kept between
+ * runs unless the parameters change.
+ */
+
+#define RS_CACHE_FINDER_NO_MAIN
+#include "../rs-cache-finder-linux.cpp"
+
+#include <random>
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+struct TreeParameters
+{
+	int depth = 4;
+	int fanout = 6;
+	int filesPerDir = 20;
+	double matchFiles = 0.05;	// Share of file names matching cachePatterns
+	double matchDirs = 0.02;	// Share of directory names matching cacheDirs
+	off_t fileSize = 32 * 1024;	// Size of every file that should be archived
+
+	std::string describe() const
+	{
+		char text[200];
+		snprintf(text, sizeof(text), "depth=%d fanout=%d files=%d match-files=%g match-dirs=%g file-size=%lld", depth, fanout, filesPerDir, matchFiles, matchDirs, (long long)fileSize);
+		return text;
+	}
+};
+
+// What went into the tree
+struct Tree
+{
+	std::vector<std::string> fileNames;
+	std::vector<std::string> dirNames;
+	std::vector<std::filesystem::path> payload;	// The files that should be archived
+	size_t dirs = 0;
+	size_t files = 0;
+};
+
+void benchHelp(const char *progname)
+{
+	printf("\nUsage: %s --tree=<dir> [--depth=<levels>] [--fanout=<dirs>] [--files=<per dir>] [--match-files=<share>] [--match-dirs=<share>] [--file-size=<bytes>] [--repeat=<runs>] [--regenerate] [--output=<file>]\n", progname);
+	printf("\n");
+	printf("--tree: where to build the synthetic tree.  It is reused if it was built with the same parameters.\n");
+	printf("--depth, --fanout, --files: levels of directories, subdirectories per directory, and files per directory.\n");
+	printf("--match-files, --match-dirs: the share of file and directory names, from 0 to 1, that match the cache tables.\n");
+	printf("--file-size: size of each file that would be archived.  Other files are empty.\n");
+	printf("--repeat: number of warm runs of each stage; the fastest is reported.  Defaults to 3.\n");
+	printf("--regenerate: rebuild the tree even if it looks up to date.\n");
+	printf("--output: where to write the JSON results.  Defaults to standard output.\n");
+	printf("\n");
+}
+
+// Compile the pattern tables the way main() does.  The built-in ones were
+// compiled along with the program.
+void compileTables()
+{
+	cacheExcludeRegexes = CompileRegexes(cacheExcludeDirs);
+	maskPathRegexes = CompileRegexes(maskPaths);
+	for(auto &prune : pruneDirs)
+	{
+		if(prune[0] != '/')
+		{
+			pruneNames.insert(prune);
+		}
+	}
+}
+
+// A literal name matching "pattern", found by reading the pattern as text:
+// anchors are dropped, escapes and the first choice of a group or character
+// class taken, and wildcards filled in.  Returns an empty string if the
+// result doesn't actually match, which happens for the odder patterns.
+std::string sampleName(const std::string &pattern)
+{
+	std::string name;
+	for(size_t i = 0; i < pattern.length(); i++)
+	{
+		char c = pattern[i];
+		char next = (i + 1 < pattern.length()) ? pattern[i + 1] : '\0';
+		if(c == '^' || c == '$' || c == '?' || c == '*' || c == '+')
+		{
+			continue;
+		}
+		if(c == '\\' && next)
+		{
+			name += next;
+			i++;
+		}
+		else if(c == '.')
+		{
+			if(next != '*')
+			{
+				name += 'x';
+			}
+		}
+		else if(c == '(' || c == '[')
+		{
+			char close = (c == '(') ? ')' : ']';
+			size_t end = pattern.find(close, i);
+			if(end == std::string::npos)
+			{
+				return std::string();
+			}
+			std::string group = pattern.substr(i + 1, end - i - 1);
+			if(c == '(')
+			{
+				name += group.substr(0, group.find('|'));
+			}
+			else if(!group.empty() && group[0] != '^')
+			{
+				name += group[0];
+			}
+			i = end;
+		}
+		else if(c == '{')
+		{
+			i = pattern.find('}', i);
+			if(i == std::string::npos)
+			{
+				return std::string();
+			}
+		}
+		else
+		{
+			name += c;
+		}
+	}
+	return PatternMatcher({pattern}).match(name) ? name : std::string();
+}
+
+std::vector<std::string> sampleNames(const std::vector<std::string> &patterns)
+{
+	std::vector<std::string> names;
+	for(auto &pattern : patterns)
+	{
+		std::string name = sampleName(pattern);
+		if(!name.empty())
+		{
+			names.push_back(name);
+		}
+	}
+	return names;
+}
+
+// Builds a tree from a fixed seed.  With "create" false nothing is written,
+// but the same names come out, which describes a tree built earlier.
+class TreeBuilder
+{
+public:
+	TreeBuilder(const TreeParameters &parameters, bool create) : parameters(parameters), create(create), random(1)
+	{
+		cacheFileNames = sampleNames(patternList(cachePatterns));
+		for(auto &name : sampleNames(patternList(cacheDirs)))
+		{
+			if(!searchRegexes(name, cacheExcludeRegexes) && !pruneNames.count(name))
+			{
+				cacheDirNames.push_back(name);
+			}
+		}
+		payloadData.resize(parameters.fileSize);
+		for(auto &byte : payloadData)
+		{
+			byte = random();
+		}
+	}
+
+	void build(const std::filesystem::path &root, Tree &tree)
+	{
+		if(create)
+		{
+			std::filesystem::create_directories(root);
+		}
+		buildDirectory(root, 0, false, tree);
+	}
+
+private:
+	bool chance(double share)
+	{
+		return std::uniform_real_distribution<double>(0, 1)(random) < share;
+	}
+
+	template<typename T>
+	const T &pick(const std::vector<T> &choices)
+	{
+		return choices[std::uniform_int_distribution<size_t>(0, choices.size() - 1)(random)];
+	}
+
+	// A name that looks like the ordinary files found on a disk
+	template<typename Matcher>
+	std::string ordinaryName(const Matcher &avoid, const char *const *extensions, size_t extensionCount)
+	{
+		static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+		while(true)
+		{
+			std::string name;
+			int length = std::uniform_int_distribution<int>(4, 14)(random);
+			for(int i = 0; i < length; i++)
+			{
+				name += letters[std::uniform_int_distribution<int>(0, sizeof(letters) - 2)(random)];
+			}
+			name += extensions[std::uniform_int_distribution<size_t>(0, extensionCount - 1)(random)];
+			if(!searchRegexes(name, avoid) && !searchRegexes(name, cacheExcludeRegexes) && !pruneNames.count(name))
+			{
+				return name;
+			}
+		}
+	}
+
+	void writeFile(const std::filesystem::path &path, bool payload)
+	{
+		int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+		if(fd == -1)
+		{
+			fprintf(stderr, "Error %s creating %s\n", strerror(errno), path.c_str());
+			throw std::runtime_error("Failed to build tree");
+		}
+		if(payload && (ssize_t)payloadData.size() != ::write(fd, payloadData.data(), payloadData.size()))
+		{
+			fprintf(stderr, "Error %s writing %s\n", strerror(errno), path.c_str());
+			close(fd);
+			throw std::runtime_error("Failed to build tree");
+		}
+		close(fd);
+	}
+
+	void buildDirectory(const std::filesystem::path &dir, int level, bool cacheDir, Tree &tree)
+	{
+		static const char *const fileExtensions[] = {"", ".txt", ".so", ".png", ".h", ".py", ".json", ".conf", ".o", ".log"};
+		static const char *const dirExtensions[] = {""};
+
+		tree.dirs++;
+		std::set<std::string> used;
+		for(int i = 0; i < parameters.filesPerDir; i++)
+		{
+			bool match = !cacheFileNames.empty() && chance(parameters.matchFiles);
+			std::string name = match ? pick(cacheFileNames) : ordinaryName(cacheRegexes, fileExtensions, sizeof(fileExtensions) / sizeof(fileExtensions[0]));
+			if(!used.insert(name).second)
+			{
+				continue;
+			}
+			// The root's files are never archived
+			bool payload = level > 0 && (match || cacheDir);
+			if(create)
+			{
+				writeFile(dir / name, payload);
+			}
+			tree.fileNames.push_back(name);
+			tree.files++;
+			if(payload)
+			{
+				tree.payload.push_back(dir / name);
+			}
+		}
+		if(level == parameters.depth)
+		{
+			return;
+		}
+		for(int i = 0; i < parameters.fanout; i++)
+		{
+			bool match = !cacheDirNames.empty() && chance(parameters.matchDirs);
+			std::string name = match ? pick(cacheDirNames) : ordinaryName(cacheDirRegexes, dirExtensions, 1);
+			if(!used.insert(name).second)
+			{
+				continue;
+			}
+			std::filesystem::path child = dir / name;
+			if(create)
+			{
+				std::filesystem::create_directory(child);
+			}
+			tree.dirNames.push_back(name);
+			buildDirectory(child, level + 1, isCacheDir(name, lastComponent(dir.native()), 0), tree);
+		}
+	}
+
+	const TreeParameters &parameters;
+	bool create;
+	std::mt19937_64 random;
+	std::vector<std::string> cacheFileNames;
+	std::vector<std::string> cacheDirNames;
+	std::vector<unsigned char> payloadData;
+};
+
+// Generate the tree, unless one built with the same parameters is already
+// there.  Either way "tree" describes it.
+void prepareTree(const std::filesystem::path &root, const TreeParameters &parameters, bool regenerate, Tree &tree)
+{
+	std::filesystem::path stamp = root.native() + ".parameters";
+	std::string wanted = parameters.describe() + "\n";
+	std::string existing;
+	if(FILE *file = fopen(stamp.c_str(), "r"))
+	{
+		char line[256];
+		if(fgets(line, sizeof(line), file))
+		{
+			existing = line;
+		}
+		fclose(file);
+	}
+	bool current = !regenerate && existing == wanted && std::filesystem::is_directory(root);
+	if(!current)
+	{
+		fprintf(stderr, "Building tree %s (%s)\n", root.c_str(), parameters.describe().c_str());
+		std::filesystem::remove_all(root);
+		std::filesystem::remove(stamp);
+	}
+
+	TreeBuilder(parameters, !current).build(root, tree);
+	if(current)
+	{
+		return;
+	}
+	if(FILE *file = fopen(stamp.c_str(), "w"))
+	{
+		fputs(wanted.c_str(), file);
+		fclose(file);
+	}
+}
+
+double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Empty the page, dentry and inode caches, which needs root.  Returns false
+// if the kernel wouldn't let us.
+bool dropCaches()
+{
+	sync();
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY|O_CLOEXEC);
+	if(fd == -1)
+	{
+		return false;
+	}
+	bool dropped = 1 == ::write(fd, "3", 1);
+	close(fd);
+	return dropped;
+}
+
+// Drop just the given files' data from the page cache, which anyone can do
+void dropFileData(const std::vector<std::filesystem::path> &files)
+{
+	for(auto &path : files)
+	{
+		int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+		if(fd != -1)
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+}
+
+// Average time per name of a matcher over a list of names, in nanoseconds.
+// The list is run through as often as it takes to fill a quarter second.
+template<typename Matcher>
+double timeMatching(const std::vector<std::string> &names, const Matcher &matcher, size_t &matches)
+{
+	if(names.empty())
+	{
+		return 0;
+	}
+	size_t passes = 0;
+	double start = now(), elapsed;
+	do
+	{
+		matches = 0;
+		for(auto &name : names)
+		{
+			matches += searchRegexes(name, matcher);
+		}
+		passes++;
+		elapsed = now() - start;
+	} while(elapsed < 0.25);
+	return elapsed * 1e9 / (passes * names.size());
+}
+
+// Silences the scanner's per-file output while it is being timed
+class QuietStdout
+{
+public:
+	QuietStdout()
+	{
+		fflush(stdout);
+		saved = dup(STDOUT_FILENO);
+		int null = open("/dev/null", O_WRONLY|O_CLOEXEC);
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	}
+
+	~QuietStdout()
+	{
+		fflush(stdout);
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+
+private:
+	int saved;
+};
+
+// Time scanPath() over the tree, finding the files without archiving them
+double timeScan(const std::filesystem::path &root, uint64_t &found)
+{
+	QuietStdout quiet;
+	gDirCounter = 0;
+	gDryRun = 1;
+	int fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+	OutputFile outfile(fd, false, OutputFile::FlushNever);
+	ArchiveWriter archive(outfile, false, false, 0, false, nullptr, true, nullptr, 0);
+	double start = now();
+	scanPath(root, archive, 0);
+	archive.finish();
+	double elapsed = now() - start;
+	found = archive.fileCount();
+	outfile.close();
+	gDryRun = 0;
+	return elapsed;
+}
+
+// Time addFileToTar() over the files that should be archived, writing to a
+// scratch file next to the tree.  Returns the throughput in MB/s.
+double timeArchive(const std::filesystem::path &root, const std::vector<std::filesystem::path> &files, uint64_t &bytes)
+{
+	std::vector<struct stat> stats(files.size());
+	std::vector<std::string> names(files.size());
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		names[i] = "dir0000001/bench/" + files[i].filename().string();
+		if(0 != stat(files[i].c_str(), &stats[i]))
+		{
+			fprintf(stderr, "Stat error %s for file %s\n", strerror(errno), files[i].c_str());
+			throw std::runtime_error("Tree is incomplete");
+		}
+	}
+
+	std::string scratch = root.native() + ".tar";
+	unlink(scratch.c_str());
+	int fd = open(scratch.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if(fd == -1)
+	{
+		fprintf(stderr, "Error %s creating %s\n", strerror(errno), scratch.c_str());
+		throw std::runtime_error("Failed to create scratch archive");
+	}
+	OutputFile outfile(fd, false, OutputFile::FlushNever);
+	bytes = 0;
+	double start = now();
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		addFileToTar(files[i], stats[i], names[i], outfile, 0);
+		bytes += stats[i].st_size;
+	}
+	outfile.close();
+	double elapsed = now() - start;
+	unlink(scratch.c_str());
+	return (elapsed > 0) ? bytes / elapsed / 1e6 : 0;
+}
+
+// A JSON number, or null for a measurement we couldn't take
+std::string jsonNumber(double value, bool valid = true)
+{
+	if(!valid)
+	{
+		return "null";
+	}
+	char text[64];
+	snprintf(text, sizeof(text), "%.6g", value);
+	return text;
+}
+
+int main(int argc, char *argv[])
+{
+	TreeParameters parameters;
+	std::filesystem::path root;
+	std::string output;
+	int repeat = 3;
+	int regenerate = 0;
+
+	static struct option long_options[] = {
+		{"tree",	required_argument,	0, 0},
+		{"depth",	required_argument,	0, 0},
+		{"fanout",	required_argument,	0, 0},
+		{"files",	required_argument,	0, 0},
+		{"match-files",	required_argument,	0, 0},
+		{"match-dirs",	required_argument,	0, 0},
+		{"file-size",	required_argument,	0, 0},
+		{"repeat",	required_argument,	0, 0},
+		{"regenerate",	no_argument,		&regenerate, 1},
+		{"output",	required_argument,	0, 0},
+		{"help",	no_argument,		0, 0},
+		{0,		0,			0, 0}
+	};
+
+	while(1)
+	{
+		int longIndex = 0;
+		int res = getopt_long(argc, argv, "", long_options, &longIndex);
+		if(res == -1)
+		{
+			break;
+		}
+		if(res == '?' || longIndex == 10)
+		{
+			benchHelp(argv[0]);
+			return (res == '?') ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+		if(longIndex == 0) root = optarg;
+		else if(longIndex == 1) parameters.depth = atoi(optarg);
+		else if(longIndex == 2) parameters.fanout = atoi(optarg);
+		else if(longIndex == 3) parameters.filesPerDir = atoi(optarg);
+		else if(longIndex == 4) parameters.matchFiles = atof(optarg);
+		else if(longIndex == 5) parameters.matchDirs = atof(optarg);
+		else if(longIndex == 6) parameters.fileSize = atoll(optarg);
+		else if(longIndex == 7) repeat = std::max(1, atoi(optarg));
+		else if(longIndex == 9) output = optarg;
+	}
+	if(root.empty())
+	{
+		benchHelp(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	try
+	{
+		compileTables();
+		Tree tree;
+		prepareTree(root, parameters, regenerate, tree);
+
+		size_t fileMatches = 0, dirMatches = 0;
+		double fileNs = timeMatching(tree.fileNames, cacheRegexes, fileMatches);
+		double dirNs = timeMatching(tree.dirNames, cacheDirRegexes, dirMatches);
+
+		// Cold runs come first, while nothing has warmed the caches since
+		// they were dropped
+		uint64_t found = 0, bytes = 0;
+		bool cold = dropCaches();
+		double coldScan = cold ? timeScan(root, found) : 0;
+		dropFileData(tree.payload);
+		dropCaches();
+		double coldArchive = timeArchive(root, tree.payload, bytes);
+
+		double warmScan = 0, warmArchive = 0;
+		timeScan(root, found);
+		for(int i = 0; i < repeat; i++)
+		{
+			double scan = timeScan(root, found);
+			warmScan = (i == 0) ? scan : std::min(warmScan, scan);
+			warmArchive = std::max(warmArchive, timeArchive(root, tree.payload, bytes));
+		}
+
+		std::string json = "{\n";
+		json += "  \"version\": \"" BENCH_VERSION "\",\n";
+		json += "  \"tree\": {\"depth\": " + std::to_string(parameters.depth) + ", \"fanout\": " + std::to_string(parameters.fanout)
+			+ ", \"files_per_dir\": " + std::to_string(parameters.filesPerDir) + ", \"match_files\": " + jsonNumber(parameters.matchFiles)
+			+ ", \"match_dirs\": " + jsonNumber(parameters.matchDirs) + ", \"file_size\": " + std::to_string(parameters.fileSize)
+			+ ", \"dirs\": " + std::to_string(tree.dirs) + ", \"files\": " + std::to_string(tree.files)
+			+ ", \"archived_files\": " + std::to_string(found) + ", \"archived_bytes\": " + std::to_string(bytes) + "},\n";
+		json += "  \"match\": {\"file_ns_per_name\": " + jsonNumber(fileNs) + ", \"file_matches\": " + std::to_string(fileMatches)
+			+ ", \"dir_ns_per_name\": " + jsonNumber(dirNs) + ", \"dir_matches\": " + std::to_string(dirMatches) + "},\n";
+		json += "  \"scan\": {\"warm_seconds\": " + jsonNumber(warmScan) + ", \"cold_seconds\": " + jsonNumber(coldScan, cold)
+			+ ", \"dirs_per_second\": " + jsonNumber(tree.dirs / warmScan, warmScan > 0) + "},\n";
+		json += "  \"archive\": {\"warm_mb_per_second\": " + jsonNumber(warmArchive) + ", \"cold_mb_per_second\": " + jsonNumber(coldArchive)
+			+ ", \"cold_is_page_cache_only\": " + (cold ? "false" : "true") + "}\n";
+		json += "}\n";
+
+		FILE *file = output.empty() ? stdout : fopen(output.c_str(), "w");
+		if(!file)
+		{
+			fprintf(stderr, "Error %s opening %s\n", strerror(errno), output.c_str());
+			return EXIT_FAILURE;
+		}
+		fputs(json.c_str(), file);
+		if(file != stdout && 0 != fclose(file))
+		{
+			fprintf(stderr, "Error %s writing %s\n", strerror(errno), output.c_str());
+			return EXIT_FAILURE;
+		}
+		if(!cold)
+		{
+			fprintf(stderr, "Note: can't drop the kernel caches without root, so the cold scan wasn't measured and the cold archive run only had file data dropped\n");
+		}
+	}
+	catch(std::exception &e)
+	{
+		fprintf(stderr, "Failed: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+/* Matcher microbenchmark and correctness oracle for rs-cache-finder-linux.
+ *
+ * Replays a corpus of filenames, one per line, through each of the pattern
+ * tables, and reports the time per filename.  The built-in tables are run as
+ * compiled into the program, and every table is also run through
+ * PatternMatcher with every set of matcher kernels the CPU can run, not just
+ * the one that would be picked.  Every name is also checked against the
+ * original matching: each pattern compiled on its own as an ECMAScript
+ * std::regex with icase, and regex_search()ed in turn.  Any disagreement is
+ * printed and makes the run fail, so a faster matcher can't quietly change
+ * what gets archived.
+ *
+ * The default corpus, bench/filenames.txt, is a sample of the names found on
+ * a Linux install together with the cache names, and near misses, found on
+ * donated disks.  Build and run with "make bench-matcher"; pass --corpus to
+ * replay names from a scan instead.
+ */
+
+#define RS_CACHE_FINDER_NO_MAIN
+#include "../rs-cache-finder-linux.cpp"
+
+// The matching we started with, before PatternMatcher: every pattern tried
+// in turn with std::regex
+class ReferenceMatcher
+{
+public:
+	explicit ReferenceMatcher(const std::vector<std::string> &patterns)
+	{
+		for(auto &pattern : patterns)
+		{
+			regexes.emplace_back(pattern, std::regex::ECMAScript|std::regex::icase|std::regex::nosubs|std::regex::optimize);
+		}
+	}
+
+	bool match(const std::string &target) const
+	{
+		std::cmatch results;
+		for(auto &regex : regexes)
+		{
+			if(std::regex_search(target.c_str(), results, regex))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	std::vector<std::regex> regexes;
+};
+
+double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Average nanoseconds per name for "match" over the corpus, running through
+// it as often as it takes to fill a quarter second
+template<typename Match>
+double timePerName(const std::vector<std::string> &names, Match match, size_t &matches)
+{
+	size_t passes = 0;
+	double start = now(), elapsed;
+	do
+	{
+		matches = 0;
+		for(auto &name : names)
+		{
+			matches += match(name);
+		}
+		passes++;
+		elapsed = now() - start;
+	} while(elapsed < 0.25);
+	return elapsed * 1e9 / (passes * names.size());
+}
+
+int main(int argc, char *argv[])
+{
+	std::string corpus = "bench/filenames.txt";
+	for(int i = 1; i < argc; i++)
+	{
+		if(0 == strncmp(argv[i], "--corpus=", 9))
+		{
+			corpus = argv[i] + 9;
+		}
+		else
+		{
+			printf("\nUsage: %s [--corpus=<file of names, one per line>]\n\n", argv[0]);
+			return (0 == strcmp(argv[i], "--help")) ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	std::vector<std::string> names;
+	FILE *file = fopen(corpus.c_str(), "r");
+	if(!file)
+	{
+		fprintf(stderr, "Error %s opening corpus %s\n", strerror(errno), corpus.c_str());
+		return EXIT_FAILURE;
+	}
+	char *line = nullptr;
+	size_t lineSize = 0;
+	ssize_t length;
+	while((length = getline(&line, &lineSize, file)) != -1)
+	{
+		if(length > 0 && line[length - 1] == '\n')
+		{
+			length--;
+		}
+		names.emplace_back(line, length);
+	}
+	free(line);
+	fclose(file);
+	if(names.empty())
+	{
+		fprintf(stderr, "Corpus %s is empty\n", corpus.c_str());
+		return EXIT_FAILURE;
+	}
+
+	// The built-in tables are timed both as compiled into the program and
+	// through PatternMatcher, which still handles --exclude and --mask-path
+	struct Table
+	{
+		const char *name;
+		std::vector<std::string> patterns;
+		bool (*builtin)(std::string_view name);
+	};
+	const Table tables[] = {
+		{"cacheRegexes", patternList(cachePatterns), [](std::string_view name) { return cacheRegexes.match(name); }},
+		{"cacheDirRegexes", patternList(cacheDirs), [](std::string_view name) { return cacheDirRegexes.match(name); }},
+		{"parentedCacheDirRegexes", patternList(parentedCacheDirs), [](std::string_view name) { return parentedCacheDirRegexes.match(name); }},
+		{"cacheDirParentRegexes", patternList(cacheDirParents), [](std::string_view name) { return cacheDirParentRegexes.match(name); }},
+		{"cacheExcludeRegexes", cacheExcludeDirs, nullptr},
+	};
+
+	printf("%zu names from %s\n\n", names.size(), corpus.c_str());
+	printf("%-24s %8s %-8s %8s %12s %12s %8s\n", "table", "patterns", "matcher", "matches", "ns/name", "regex ns", "speedup");
+	size_t mismatches = 0;
+	std::vector<MatchKernels> kernels = availableMatchKernels();
+	for(auto &table : tables)
+	{
+		ReferenceMatcher reference(table.patterns);
+		size_t referenceMatches = 0;
+		double referenceNs = timePerName(names, [&](const std::string &name) { return reference.match(name); }, referenceMatches);
+		std::vector<bool> expected;
+		for(auto &name : names)
+		{
+			expected.push_back(reference.match(name));
+		}
+
+		auto check = [&](const char *matcherName, auto match)
+		{
+			size_t matches = 0;
+			double ns = timePerName(names, match, matches);
+			printf("%-24s %8zu %-8s %8zu %12.1f %12.1f %7.1fx\n", table.name, table.patterns.size(), matcherName, matches, ns, referenceNs, referenceNs / ns);
+
+			for(size_t i = 0; i < names.size(); i++)
+			{
+				bool found = match(names[i]);
+				if(found != expected[i])
+				{
+					if(mismatches++ < 50)
+					{
+						fprintf(stderr, "Mismatch in %s with %s for \"%s\": matcher says %s, std::regex says %s\n", table.name, matcherName, names[i].c_str(), found ? "match" : "no match", found ? "no match" : "match");
+					}
+				}
+			}
+		};
+
+		if(table.builtin)
+		{
+			check("builtin", [&](const std::string &name) { return table.builtin(name); });
+		}
+		for(auto &kernel : kernels)
+		{
+			gMatchKernels = kernel;
+			PatternMatcher matcher = CompileRegexes(table.patterns);
+			check(kernel.name, [&](const std::string &name) { return searchRegexes(name, matcher); });
+		}
+	}
+
+	if(mismatches)
+	{
+		fprintf(stderr, "\n%zu mismatches against std::regex\n", mismatches);
+		return EXIT_FAILURE;
+	}
+	printf("\nAll names match std::regex\n");
+	return EXIT_SUCCESS;
+}
@@ -1,33 +1,81 @@
 /* CLI Runescape cache finder for Linux.
  *
- * Creates a gzipped tarball of the files found.
+ * Creates a tarball of the files found, optionally gzip- or zstd-compressed.
  *
  * Copyright (c) 2024 Carnildo.
  * Licensed under the Creative Commons CC-0 license
  */
 
 // Written in C++-17
-// Compile: g++ -o rs-cache-finder-linux rs-cache-finder-linux.cpp
+// Compile: g++ -std=c++17 -pthread -o rs-cache-finder-linux rs-cache-finder-linux.cpp -lz
+// Add -DHAVE_ZSTD and -lzstd for zstd support
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctype.h>
+#include <dirent.h>
+#include <deque>
 #include <errno.h>
+#include <exception>
+#include <fcntl.h>
 #include <filesystem>
 #include <getopt.h>
+#include <iterator>
+#include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <linux/magic.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <queue>
 #include <regex>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <set>
+#include <signal.h>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <thread>
+#include <unordered_set>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#ifdef __aarch64__
+#include <arm_neon.h>
+#endif
 
 // Counter used to create unique, anonymous names for any directories added
 // to the output tarball.  Anonymizing directory names has two benefits:
 //  1. It protects user privacy
 //  2. It ensures filenames are short enough to fit into a Tar metadata
 //     block.
-int gDirCounter = 0;
+std::atomic<int> gDirCounter{0};
 
 void showhelp(const char *progname, const char *message = nullptr)
 {
@@ -35,10 +83,38 @@ void showhelp(const char *progname, const char *message = nullptr)
 	{
 		printf("%s\n", message);
 	}
-	printf("\nUsage: %s [--help] [--verbose] [--exclude=<regex to exclude>] [--mask-path=<regex of path name to mask>] <search_path> <output_path>\n", progname);
+	printf("\nUsage: %s [--help] [--verbose] [--exclude=<regex to exclude>] [--mask-path=<regex of path name to mask>] [--jobs=<threads>] [--deterministic] [--direct-io] [--flush=safe|never|end|<MB>] [--compress=gzip|zstd] [--compress-level=<level>] [--compress-threads=<threads>] [--read-ahead=<files>] [--max-depth=<levels>] [--max-open-dirs=<count>] [--prune=<name>|</path>] [--one-file-system] [--state-file=<file>] [--delta] [--dedup] [--manifest=<file>] [--dry-run] [--from-manifest=<file>] [--progress[=<seconds>]] [--profile=<file>] [--device-jobs=<threads>] [--split-size=<MB>] [--volumes=<count>] [--volume-dir=<dir>] [--prefetch[=<MB>]] [--checkpoint[=<seconds>]] [--resume] <search_path>... <output_path>|-|tcp://<host>:<port>|http://<host>[:<port>]/<path>\n", progname);
 	printf("\n");
 	printf("--exclude: a ECMA regular expression matching folders to exclude from searching for cache files, usually because it contains false positives.  Can be specified multiple times.\n");
 	printf("--mask-path: an ECMA regular expression matching folder names to replace with 'folder', generally because it contains sensitive information such as a username.  Can be specified multiple times.\n");
+	printf("--jobs: number of threads to scan directories with.  Defaults to 1; higher values help on SSDs and network filesystems, where scanning is limited by latency.  Several search paths are then scanned at the same time.\n");
+	printf("--device-jobs: with --jobs, the most threads scanning any one disk at a time, so that search paths on partitions of the same disk don't slow each other down.  Defaults to --jobs.\n");
+	printf("--deterministic: archive files in path order, so that scanning the same disk twice produces byte-for-byte identical output no matter how many jobs are used.\n");
+	printf("--direct-io: write the archive with O_DIRECT, bypassing the page cache.\n");
+	printf("--flush: when to push the archive to disk.  'safe' (the default) flushes after every file, or every batch of small files from one directory, 'never' only when the write buffer fills, 'end' fsyncs once when the archive is complete, and a number flushes and syncs every that many megabytes.\n");
+	printf("--compress: compress the archive with gzip or zstd as it is written.  Compression runs on its own threads, in parallel with scanning; it works best with --flush=never or --flush=end, since every flush ends a compressed block early.\n");
+	printf("--compress-level: compression level, from 0 to 9 for gzip (default 6) or 1 to 19 for zstd (default 3).\n");
+	printf("--compress-threads: number of compression threads.  Defaults to the number of CPUs.\n");
+	printf("--read-ahead: number of files to keep reading ahead of the archive writer, using io_uring where the kernel allows it.  Helps most on spinning disks and USB images.  Files over 4 MB are not read ahead.\n");
+	printf("--max-depth: how many levels of directories below the search path to scan.  Defaults to no limit.\n");
+	printf("--max-open-dirs: number of directory handles to keep open while scanning, so that subdirectories can be opened without looking up their whole path again.  Defaults to 256, and never more than half the open file limit.\n");
+	printf("--prune: a directory name, or a path relative to the search path if it starts with '/', that is skipped without being opened.  Adds to a built-in list of places that never hold caches, such as .git and /proc.  Can be specified multiple times.\n");
+	printf("--one-file-system: don't descend into directories on other filesystems than the search path.  Pseudo-filesystems such as /proc and /sys are always skipped.\n");
+	printf("--state-file: an index of what was found, read at the start of the scan and rewritten at the end.  Directories that haven't changed since are not read again, and every directory keeps its number in the archive from one scan to the next.  An index written with different search paths, --prune, --exclude, --max-depth or --one-file-system is ignored.\n");
+	printf("--delta: with --state-file, only archive files that are new or changed since the state file was written.  Extracting the result over the earlier archive brings it up to date.\n");
+	printf("--dedup: store files whose contents are already in the archive as hard links to the first copy.  Only files with the same size as an earlier one are read an extra time to check.\n");
+	printf("--manifest: write a JSON line for every file chosen for the archive, with its name in the archive, its path, size and mtime, and the pattern that chose it.\n");
+	printf("--dry-run: scan without reading or archiving any files, to see what there is.  No output path is taken; every path given is searched.\n");
+	printf("--from-manifest: archive the files listed in a manifest instead of scanning, under the same names, reading them in the order they are stored on disk.  No search path is needed.\n");
+	printf("--progress: print a line to stderr every 5 seconds, or as often as given, with how far the scan has got, its speed and an estimate of the time left, and a summary at the end.\n");
+	printf("--profile: write a JSON report of where the time went: reading directories, matching names, stat, reading files, writing and syncing the archive, with latency histograms and the slowest directories and files.\n");
+	printf("--split-size: start a new volume of the archive before one would grow past this many megabytes, counted before compression.  Every volume is a tar archive of its own, and the files of a directory are never split between volumes.\n");
+	printf("--volumes: write this many volumes at the same time, each on its own thread.  Volumes are numbered output.001.tar, output.002.tar and so on, and an index of which volume holds each directory is written to <output_path>.index.\n");
+	printf("--volume-dir: with --split-size or --volumes, a directory to write volumes to, in turn, instead of next to the output path.  Can be specified multiple times.\n");
+	printf("--prefetch: ask the kernel to start reading files before they are archived, up to 64 megabytes ahead or as many as given, and look up the entries of each directory all at once, using io_uring where the kernel allows it.  Hides the latency of spinning disks and network filesystems; on an SSD, or with everything already cached, it only adds work.\n");
+	printf("--checkpoint: every 60 seconds, or as often as given, sync the archive and note in <output_path>.checkpoint how far it has got, which directories are done and which files are in it.  The checkpoint is deleted once the archive is complete.  A compressed archive carries on after each checkpoint in a new gzip member or zstd frame, which gzip, zstd and tar read as one.\n");
+	printf("--resume: carry on an archive that was being written with --checkpoint when the run stopped.  Give the same options and paths as before with --resume added.  The archive, and the manifest if there is one, are cut back to the last checkpoint, directories that were done are descended through without being read again, and files already in the archive are not added again.  --dedup only links to files archived since resuming.\n");
+	printf("output_path: a new file to write the archive to, or '-' for stdout, tcp://host:port to send it over a TCP connection, or http://host[:port]/path to upload it with an HTTP PUT.  Nothing is staged on disk; scanning slows down to the speed of the connection.  --flush=never saves sending a packet for every small file.\n");
 	printf("\n");
 }
 
@@ -53,8 +129,1278 @@ void printIfVerbose(int verbose, const char *format, ...)
 	}
 }
 
+// Running totals for --progress.  Every thread counts into a block of its
+// own, padded out to a cache line so that no two threads ever write to the
+// same one, and the blocks are only summed when a progress line is printed.
+class Stats
+{
+public:
+	enum Counter
+	{
+		Dirs,		// Directories scanned
+		Entries,	// Directory entries examined
+		Matches,	// Files chosen for the archive
+		BytesRead,	// File contents read, including to check --dedup copies
+		BytesWritten,	// Archive handed to the kernel, after compression
+		Errors,		// Files and directories that had to be skipped
+		CounterCount
+	};
+
+	typedef std::array<uint64_t, CounterCount> Totals;
+
+	static void add(Counter counter, uint64_t amount = 1)
+	{
+		// Only this thread writes to its block, so a plain load and
+		// store will do instead of a locked add
+		std::atomic<uint64_t> &value = local().values[counter];
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	// The sum over every thread, including the ones that have finished
+	static Totals totals();
+
+private:
+	struct alignas(64) Block
+	{
+		std::atomic<uint64_t> values[CounterCount] = {};
+	};
+
+	static Block &local();
+
+	static std::mutex lock;
+	static std::vector<std::unique_ptr<Block>> blocks;
+};
+
+std::mutex Stats::lock;
+std::vector<std::unique_ptr<Stats::Block>> Stats::blocks;
+
+Stats::Totals Stats::totals()
+{
+	Totals sum{};
+	std::lock_guard<std::mutex> guard(lock);
+	for(auto &block : blocks)
+	{
+		for(int i = 0; i < CounterCount; i++)
+		{
+			sum[i] += block->values[i].load(std::memory_order_relaxed);
+		}
+	}
+	return sum;
+}
+
+// A thread's block is made the first time it counts anything, and kept after
+// the thread exits so that its counts still add up
+Stats::Block &Stats::local()
+{
+	static thread_local Block *block = nullptr;
+	if(!block)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		blocks.push_back(std::make_unique<Block>());
+		block = blocks.back().get();
+	}
+	return *block;
+}
+
+// Where the time goes, for --profile.  Time is split between the phases
+// below, and every directory and archived file gets its latency recorded in
+// a histogram, with the slowest kept by name.  Like Stats, each thread
+// records into a block of its own; the blocks are only read once every
+// thread is done, when the profile is written out.  Nothing is timed unless
+// a profile was asked for.
+class Profile
+{
+public:
+	enum Phase
+	{
+		Enumerate,	// Reading directory listings
+		Classify,	// Matching names against the patterns
+		StatFile,	// stat() calls
+		ReadFile,	// Reading files, or waiting for --read-ahead to
+		WriteTar,	// Writing the archive out, or handing it to the compressor
+		Flush,		// fsync() and fdatasync()
+		Prefetch,	// Asking the kernel to read files ahead, for --prefetch
+		PhaseCount
+	};
+
+	enum Item
+	{
+		Directory,	// All the work on one directory's listing
+		File,		// Reading one file into the archive
+		ItemCount
+	};
+
+	// Times a phase from construction to destruction
+	class Timer
+	{
+	public:
+		explicit Timer(Phase phase) : phase(phase), start(enabled ? nanoseconds() : 0) {}
+		~Timer()
+		{
+			if(start)
+			{
+				addPhase(phase, nanoseconds() - start);
+			}
+		}
+
+	private:
+		Phase phase;
+		uint64_t start;
+	};
+
+	// Times the work on one directory or file
+	class ItemTimer
+	{
+	public:
+		ItemTimer(Item item, const std::filesystem::path &path) : item(item), path(path), start(enabled ? nanoseconds() : 0) {}
+		~ItemTimer()
+		{
+			stop();
+		}
+
+		// Stop the timer early
+		void stop()
+		{
+			if(start)
+			{
+				addItem(item, path, nanoseconds() - start);
+				start = 0;
+			}
+		}
+
+	private:
+		Item item;
+		const std::filesystem::path &path;
+		uint64_t start;
+	};
+
+	// Start profiling, to be written to "filename" at the end
+	static void open(const std::string &filename);
+
+	// Write the profile out, once everything being timed has finished
+	static void write();
+
+	static bool enabled;
+
+private:
+	static const int slowestKept = 20;
+	static const int buckets = 33;	// Powers of two of microseconds, up to over an hour
+
+	struct Slow
+	{
+		uint64_t time;
+		std::string path;
+
+		bool operator<(const Slow &other) const
+		{
+			return time > other.time;	// So that the heap's top is the fastest
+		}
+	};
+
+	struct alignas(64) Block
+	{
+		uint64_t phaseTime[PhaseCount] = {};
+		uint64_t phaseCount[PhaseCount] = {};
+		uint64_t histogram[ItemCount][buckets] = {};
+		std::vector<Slow> slowest[ItemCount];
+	};
+
+	static uint64_t nanoseconds()
+	{
+		struct timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+	}
+
+	static void addPhase(Phase phase, uint64_t time);
+	static void addItem(Item item, const std::filesystem::path &path, uint64_t time);
+	static Block &local();
+
+	static std::string filename;
+	static FILE *file;
+	static uint64_t startTime;
+	static std::mutex lock;
+	static std::vector<std::unique_ptr<Block>> blocks;
+};
+
+bool Profile::enabled = false;
+std::string Profile::filename;
+FILE *Profile::file = nullptr;
+uint64_t Profile::startTime = 0;
+std::mutex Profile::lock;
+std::vector<std::unique_ptr<Profile::Block>> Profile::blocks;
+
+void Profile::addPhase(Phase phase, uint64_t time)
+{
+	Block &block = local();
+	block.phaseTime[phase] += time;
+	block.phaseCount[phase]++;
+}
+
+void Profile::addItem(Item item, const std::filesystem::path &path, uint64_t time)
+{
+	Block &block = local();
+	int bucket = 0;
+	for(uint64_t micros = time / 1000; micros && bucket < buckets - 1; micros >>= 1)
+	{
+		bucket++;
+	}
+	block.histogram[item][bucket]++;
+
+	// A heap of the slowest so far, which only needs the path copied for
+	// the few that get into it
+	std::vector<Slow> &slowest = block.slowest[item];
+	if(slowest.size() < slowestKept)
+	{
+		slowest.push_back({time, path.native()});
+		std::push_heap(slowest.begin(), slowest.end());
+	}
+	else if(time > slowest.front().time)
+	{
+		std::pop_heap(slowest.begin(), slowest.end());
+		slowest.back() = {time, path.native()};
+		std::push_heap(slowest.begin(), slowest.end());
+	}
+}
+
+Profile::Block &Profile::local()
+{
+	static thread_local Block *block = nullptr;
+	if(!block)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		blocks.push_back(std::make_unique<Block>());
+		block = blocks.back().get();
+	}
+	return *block;
+}
+
+// A list of case-insensitive ECMAScript patterns, compiled so that a name can
+// be checked against the whole list in a single pass.  This is for the
+// patterns given on the command line; the built-in tables are compiled along
+// with the program, by BuiltinMatcher below.
+//
+// Most of the patterns we use are plain literals: "^1jfds" (prefix), "\.jag$"
+// (suffix), "^code\.dat$" (exact) or "mudclient" (substring).  Those are
+// sorted into a prefix trie, a suffix trie and an Aho-Corasick automaton,
+// none of which need to backtrack.  Only the truly irregular patterns are
+// handed to std::regex, and even then only after checking any literal prefix
+// or suffix the pattern requires.
+//
+// Names are case-folded with vector instructions.  When there are only a few
+// substring literals, as is usual, the name is searched for each of
+// them 16 or 32 positions at a time instead of going through the automaton
+// byte by byte, so names that match nothing are turned away quickly.
+class PatternMatcher
+{
+public:
+	PatternMatcher() = default;
+	explicit PatternMatcher(const std::vector<std::string> &patterns);
+
+	bool match(std::string_view target) const;
+
+private:
+	// One element of a pattern: a literal character, a '.' wildcard, or
+	// something only a real regex engine understands.
+	struct Token
+	{
+		enum Kind { Literal, Wildcard, Special } kind;
+		unsigned char c;
+	};
+
+	struct TrieNode
+	{
+		std::vector<std::pair<unsigned char, int>> children;
+		int any = -1;			// Child reached through a '.' wildcard
+		bool terminal = false;		// A pattern ends here
+		bool terminalAtEnd = false;	// A pattern ends here if the name does too
+	};
+
+	struct Trie
+	{
+		std::vector<TrieNode> nodes = std::vector<TrieNode>(1);
+
+		void insert(const std::vector<Token> &tokens, bool reversed, bool atEnd);
+		bool matches(int node, const unsigned char *name, size_t length, ptrdiff_t step) const;
+		int child(int node, unsigned char c) const;
+	};
+
+	struct GuardedRegex
+	{
+		std::regex regex;
+		std::string prefix;	// Literal, case-folded prefix the name must start with
+		std::string suffix;	// Literal, case-folded suffix the name must end with
+	};
+
+	static std::vector<Token> tokenize(const std::string &pattern, bool &anchoredStart, bool &anchoredEnd, bool &alternation);
+	void addSubstring(const std::vector<Token> &tokens);
+	void buildAutomaton();
+
+	Trie prefixes;
+	Trie suffixes;
+
+	// Case-folded substring literals, searched for directly instead of
+	// through the automaton while there are no more than maxKeywords of
+	// them and the kernels can.  Beyond that this is left empty.
+	std::vector<std::string> keywords;
+
+	static const size_t maxKeywords = 8;
+
+	// Aho-Corasick automaton for unanchored literals.  acTrie holds the
+	// keyword trie while patterns are being added; acGoto is the resulting
+	// DFA, 256 entries per state.
+	Trie acTrie;
+	std::vector<int> acGoto;
+	std::vector<bool> acOutput;
+
+	std::vector<GuardedRegex> regexes;
+};
+
+static constexpr unsigned char foldCase(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// ECMAScript's '.' matches anything except a line terminator
+static constexpr bool isLineTerminator(unsigned char c)
+{
+	return c == '\n' || c == '\r';
+}
+
+// The matcher's inner loops, in versions for each instruction set we can use,
+// picked once at startup for the CPU we are on.
+//
+// fold() case-folds "length" bytes into "dest", which must have room for
+// kernelPadding bytes beyond them.  contains() looks for the folded "word"
+// in a folded name, comparing the word's first and last bytes at many
+// positions at once and only checking the rest where both agree.  It may
+// read up to kernelPadding bytes past the end of the name, which fold()
+// leaves readable.  Without vector instructions there is no contains(), as
+// the automaton is quicker than searching for each word one byte at a time.
+struct MatchKernels
+{
+	const char *name;
+	void (*fold)(const unsigned char *source, unsigned char *dest, size_t length);
+	bool (*contains)(const unsigned char *name, size_t length, const unsigned char *word, size_t wordLength);
+};
+
+static const size_t kernelPadding = 32;
+
+void foldScalar(const unsigned char *source, unsigned char *dest, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		dest[i] = foldCase(source[i]);
+	}
+	memset(dest + length, 0, kernelPadding);
+}
+
+// The vector versions share their shape: fold whole vectors, then the tail
+// through a zeroed vector-sized copy so as never to read past the source
+#define FOLD_KERNEL(Vector, width, load, store, foldVector) \
+	size_t i = 0; \
+	for(; i + width <= length; i += width) \
+	{ \
+		Vector v = load(source + i); \
+		store(dest + i, foldVector(v)); \
+	} \
+	unsigned char tail[width] = {}; \
+	memcpy(tail, source + i, length - i); \
+	store(dest + i, foldVector(load(tail))); \
+	memset(dest + length, 0, kernelPadding);
+
+// Positions past the last place the word could start are masked off, so the
+// padding never produces a match
+#define CONTAINS_KERNEL(width, candidates) \
+	if(wordLength == 0) \
+	{ \
+		return true; \
+	} \
+	for(size_t i = 0; i + wordLength <= length; i += width) \
+	{ \
+		uint64_t mask = candidates(i); \
+		size_t starts = length - wordLength + 1 - i; \
+		if(starts < width) \
+		{ \
+			mask &= (1ull << starts) - 1; \
+		} \
+		while(mask) \
+		{ \
+			if(0 == memcmp(name + i + __builtin_ctzll(mask), word, wordLength)) \
+			{ \
+				return true; \
+			} \
+			mask &= mask - 1; \
+		} \
+	} \
+	return false;
+
+#ifdef __SSE2__
+static inline __m128i foldSSE2(__m128i v)
+{
+	__m128i upper = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8('A')), v), _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8('Z')), v));
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static inline __m128i loadSSE2(const unsigned char *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline void storeSSE2(unsigned char *p, __m128i v)
+{
+	_mm_storeu_si128((__m128i *)p, v);
+}
+
+void foldSSE2(const unsigned char *source, unsigned char *dest, size_t length)
+{
+	FOLD_KERNEL(__m128i, 16, loadSSE2, storeSSE2, foldSSE2)
+}
+
+bool containsSSE2(const unsigned char *name, size_t length, const unsigned char *word, size_t wordLength)
+{
+	__m128i first = _mm_set1_epi8(word[0]);
+	__m128i last = _mm_set1_epi8(word[wordLength ? wordLength - 1 : 0]);
+	auto candidates = [&](size_t i) -> uint64_t
+	{
+		__m128i a = _mm_cmpeq_epi8(loadSSE2(name + i), first);
+		__m128i b = _mm_cmpeq_epi8(loadSSE2(name + i + wordLength - 1), last);
+		return (unsigned)_mm_movemask_epi8(_mm_and_si128(a, b));
+	};
+	CONTAINS_KERNEL(16, candidates)
+}
+#endif
+
+#ifdef __x86_64__
+__attribute__((target("avx2"))) static inline __m256i foldAVX2(__m256i v)
+{
+	__m256i upper = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8('A')), v), _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8('Z')), v));
+	return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) static inline __m256i loadAVX2(const unsigned char *p)
+{
+	return _mm256_loadu_si256((const __m256i *)p);
+}
+
+__attribute__((target("avx2"))) static inline void storeAVX2(unsigned char *p, __m256i v)
+{
+	_mm256_storeu_si256((__m256i *)p, v);
+}
+
+__attribute__((target("avx2"))) void foldAVX2(const unsigned char *source, unsigned char *dest, size_t length)
+{
+	FOLD_KERNEL(__m256i, 32, loadAVX2, storeAVX2, foldAVX2)
+}
+
+__attribute__((target("avx2"))) bool containsAVX2(const unsigned char *name, size_t length, const unsigned char *word, size_t wordLength)
+{
+	__m256i first = _mm256_set1_epi8(word[0]);
+	__m256i last = _mm256_set1_epi8(word[wordLength ? wordLength - 1 : 0]);
+	auto candidates = [&](size_t i) __attribute__((target("avx2"))) -> uint64_t
+	{
+		__m256i a = _mm256_cmpeq_epi8(loadAVX2(name + i), first);
+		__m256i b = _mm256_cmpeq_epi8(loadAVX2(name + i + wordLength - 1), last);
+		return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+	};
+	CONTAINS_KERNEL(32, candidates)
+}
+#endif
+
+#ifdef __aarch64__
+static inline uint8x16_t foldNEON(uint8x16_t v)
+{
+	uint8x16_t upper = vandq_u8(vcgeq_u8(v, vdupq_n_u8('A')), vcleq_u8(v, vdupq_n_u8('Z')));
+	return vorrq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20)));
+}
+
+void foldNEON(const unsigned char *source, unsigned char *dest, size_t length)
+{
+	FOLD_KERNEL(uint8x16_t, 16, vld1q_u8, vst1q_u8, foldNEON)
+}
+
+bool containsNEON(const unsigned char *name, size_t length, const unsigned char *word, size_t wordLength)
+{
+	uint8x16_t first = vdupq_n_u8(word[0]);
+	uint8x16_t last = vdupq_n_u8(word[wordLength ? wordLength - 1 : 0]);
+	auto candidates = [&](size_t i) -> uint64_t
+	{
+		uint8x16_t both = vandq_u8(vceqq_u8(vld1q_u8(name + i), first), vceqq_u8(vld1q_u8(name + i + wordLength - 1), last));
+		// NEON has no movemask; narrowing leaves four bits per byte
+		uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(both), 4)), 0);
+		uint64_t mask = 0;
+		for(int bit = 0; nibbles; bit++, nibbles >>= 4)
+		{
+			mask |= (uint64_t)(nibbles & 1) << bit;
+		}
+		return mask;
+	};
+	CONTAINS_KERNEL(16, candidates)
+}
+#endif
+
+#undef FOLD_KERNEL
+#undef CONTAINS_KERNEL
+
+// Every set of kernels this CPU can run, best first
+std::vector<MatchKernels> availableMatchKernels()
+{
+	std::vector<MatchKernels> kernels;
+#ifdef __x86_64__
+	// We run from a static initialiser, possibly before libgcc has looked
+	// at the CPU itself
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		kernels.push_back({"avx2", foldAVX2, containsAVX2});
+	}
+#endif
+#ifdef __SSE2__
+	kernels.push_back({"sse2", foldSSE2, containsSSE2});
+#endif
+#ifdef __aarch64__
+	kernels.push_back({"neon", foldNEON, containsNEON});
+#endif
+	kernels.push_back({"scalar", foldScalar, nullptr});
+	return kernels;
+}
+
+MatchKernels gMatchKernels = availableMatchKernels().front();
+
+PatternMatcher::PatternMatcher(const std::vector<std::string> &patterns)
+{
+	for(auto &pattern : patterns)
+	{
+		bool anchoredStart, anchoredEnd, alternation;
+		std::vector<Token> tokens = tokenize(pattern, anchoredStart, anchoredEnd, alternation);
+		bool special = false;
+		bool wildcard = false;
+		for(auto &token : tokens)
+		{
+			special |= (token.kind == Token::Special);
+			wildcard |= (token.kind == Token::Wildcard);
+		}
+
+		if(!special && anchoredStart)
+		{
+			prefixes.insert(tokens, false, anchoredEnd);
+		}
+		else if(!special && anchoredEnd)
+		{
+			suffixes.insert(tokens, true, false);
+		}
+		else if(!special && !wildcard)
+		{
+			addSubstring(tokens);
+		}
+		else
+		{
+			GuardedRegex guarded;
+			guarded.regex = std::regex(pattern, std::regex::ECMAScript|std::regex::icase|std::regex::nosubs|std::regex::optimize);
+			if(anchoredStart && !alternation)
+			{
+				size_t i = 0;
+				while(i < tokens.size() && tokens[i].kind == Token::Literal)
+				{
+					i++;
+				}
+				// A quantifier makes the character before it optional
+				if(i < tokens.size() && i > 0 && strchr("*?{", tokens[i].c))
+				{
+					i--;
+				}
+				for(size_t j = 0; j < i; j++)
+				{
+					guarded.prefix += tokens[j].c;
+				}
+			}
+			if(anchoredEnd && !alternation)
+			{
+				size_t i = tokens.size();
+				while(i > 0 && tokens[i-1].kind == Token::Literal)
+				{
+					i--;
+				}
+				for(size_t j = i; j < tokens.size(); j++)
+				{
+					guarded.suffix += tokens[j].c;
+				}
+			}
+			regexes.push_back(std::move(guarded));
+		}
+	}
+	if(keywords.size() > maxKeywords)
+	{
+		keywords.clear();
+	}
+	buildAutomaton();
+}
+
+// Split a pattern into tokens, stripping the leading '^' and trailing '$'
+// anchors.  "alternation" is set if the pattern has a '|' outside of any
+// group, which means the anchors don't apply to the whole pattern.
+std::vector<PatternMatcher::Token> PatternMatcher::tokenize(const std::string &pattern, bool &anchoredStart, bool &anchoredEnd, bool &alternation)
+{
+	std::vector<Token> tokens;
+	size_t begin = 0;
+	size_t end = pattern.length();
+	anchoredStart = (end > 0 && pattern[0] == '^');
+	if(anchoredStart)
+	{
+		begin = 1;
+	}
+	anchoredEnd = false;
+	if(end > begin && pattern[end-1] == '$')
+	{
+		// The '$' is only an anchor if it isn't escaped
+		size_t backslashes = 0;
+		while(end - 1 - backslashes > begin && pattern[end-2-backslashes] == '\\')
+		{
+			backslashes++;
+		}
+		if(backslashes % 2 == 0)
+		{
+			anchoredEnd = true;
+			end--;
+		}
+	}
+
+	alternation = false;
+	int depth = 0;
+	for(size_t i = begin; i < end; i++)
+	{
+		unsigned char c = pattern[i];
+		if(c == '\\')
+		{
+			if(i + 1 < end && !isalnum((unsigned char)pattern[i+1]))
+			{
+				tokens.push_back({Token::Literal, foldCase(pattern[++i])});
+			}
+			else
+			{
+				// Character class escapes, backreferences, word
+				// boundaries, or a dangling backslash
+				tokens.push_back({Token::Special, c});
+				i++;
+			}
+		}
+		else if(c == '[')
+		{
+			tokens.push_back({Token::Special, c});
+			for(i++; i < end && pattern[i] != ']'; i++)
+			{
+				if(pattern[i] == '\\')
+				{
+					i++;
+				}
+			}
+		}
+		else if(c == '.')
+		{
+			tokens.push_back({Token::Wildcard, c});
+		}
+		else if(strchr("^$*+?{}()]|", c))
+		{
+			if(c == '(')
+			{
+				depth++;
+			}
+			else if(c == ')')
+			{
+				depth--;
+			}
+			else if(c == '|' && depth == 0)
+			{
+				alternation = true;
+			}
+			tokens.push_back({Token::Special, c});
+		}
+		else
+		{
+			tokens.push_back({Token::Literal, foldCase(c)});
+		}
+	}
+	return tokens;
+}
+
+int PatternMatcher::Trie::child(int node, unsigned char c) const
+{
+	for(auto &edge : nodes[node].children)
+	{
+		if(edge.first == c)
+		{
+			return edge.second;
+		}
+	}
+	return -1;
+}
+
+void PatternMatcher::Trie::insert(const std::vector<Token> &tokens, bool reversed, bool atEnd)
+{
+	int node = 0;
+	for(size_t i = 0; i < tokens.size(); i++)
+	{
+		const Token &token = tokens[reversed ? tokens.size() - 1 - i : i];
+		int next = (token.kind == Token::Wildcard) ? nodes[node].any : child(node, token.c);
+		if(next == -1)
+		{
+			next = nodes.size();
+			nodes.emplace_back();
+			if(token.kind == Token::Wildcard)
+			{
+				nodes[node].any = next;
+			}
+			else
+			{
+				nodes[node].children.emplace_back(token.c, next);
+			}
+		}
+		node = next;
+	}
+	if(atEnd)
+	{
+		nodes[node].terminalAtEnd = true;
+	}
+	else
+	{
+		nodes[node].terminal = true;
+	}
+}
+
+// Walk the trie from "node" along a case-folded name.  "step" is 1 to walk
+// forwards from the start of the name, or -1 to walk backwards, in which case
+// "name" points at the last character.
+bool PatternMatcher::Trie::matches(int node, const unsigned char *name, size_t length, ptrdiff_t step) const
+{
+	while(true)
+	{
+		const TrieNode &current = nodes[node];
+		if(current.terminal || (current.terminalAtEnd && length == 0))
+		{
+			return true;
+		}
+		if(length == 0)
+		{
+			return false;
+		}
+		// Wildcards are rare enough that simply recursing on them is cheap
+		if(current.any != -1 && !isLineTerminator(*name) && matches(current.any, name + step, length - 1, step))
+		{
+			return true;
+		}
+		node = child(node, *name);
+		if(node == -1)
+		{
+			return false;
+		}
+		name += step;
+		length--;
+	}
+}
+
+void PatternMatcher::addSubstring(const std::vector<Token> &tokens)
+{
+	acTrie.insert(tokens, false, false);
+	std::string keyword;
+	for(auto &token : tokens)
+	{
+		keyword += foldCase(token.c);
+	}
+	keywords.push_back(std::move(keyword));
+}
+
+// Turn the keyword trie into a dense Aho-Corasick DFA
+void PatternMatcher::buildAutomaton()
+{
+	if(acTrie.nodes.size() == 1 && !acTrie.nodes[0].terminal)
+	{
+		return;
+	}
+	size_t states = acTrie.nodes.size();
+	acGoto.assign(states * 256, 0);
+	acOutput.assign(states, false);
+	std::vector<int> fail(states, 0);
+	std::vector<int> queue;
+
+	acOutput[0] = acTrie.nodes[0].terminal;
+	for(auto &edge : acTrie.nodes[0].children)
+	{
+		acGoto[edge.first] = edge.second;
+		queue.push_back(edge.second);
+	}
+	for(size_t head = 0; head < queue.size(); head++)
+	{
+		int state = queue[head];
+		acOutput[state] = acTrie.nodes[state].terminal || acOutput[fail[state]];
+		for(int c = 0; c < 256; c++)
+		{
+			acGoto[state*256 + c] = acGoto[fail[state]*256 + c];
+		}
+		for(auto &edge : acTrie.nodes[state].children)
+		{
+			fail[edge.second] = acGoto[fail[state]*256 + edge.first];
+			acGoto[state*256 + edge.first] = edge.second;
+			queue.push_back(edge.second);
+		}
+	}
+}
+
+bool PatternMatcher::match(std::string_view target) const
+{
+	// Fold case once, up front, so none of the automata need to
+	unsigned char stackBuffer[256 + kernelPadding];
+	std::vector<unsigned char> heapBuffer;
+	unsigned char *name = stackBuffer;
+	size_t length = target.length();
+	if(length > sizeof(stackBuffer) - kernelPadding)
+	{
+		heapBuffer.resize(length + kernelPadding);
+		name = heapBuffer.data();
+	}
+	gMatchKernels.fold((const unsigned char *)target.data(), name, length);
+
+	if(prefixes.matches(0, name, length, 1))
+	{
+		return true;
+	}
+	if(suffixes.matches(0, length ? name + length - 1 : name, length, -1))
+	{
+		return true;
+	}
+	bool searched = gMatchKernels.contains && !keywords.empty();
+	if(searched)
+	{
+		for(auto &keyword : keywords)
+		{
+			if(gMatchKernels.contains(name, length, (const unsigned char *)keyword.data(), keyword.size()))
+			{
+				return true;
+			}
+		}
+	}
+	else if(!acGoto.empty())
+	{
+		if(acOutput[0])
+		{
+			return true;
+		}
+		int state = 0;
+		for(size_t i = 0; i < length; i++)
+		{
+			state = acGoto[state*256 + name[i]];
+			if(acOutput[state])
+			{
+				return true;
+			}
+		}
+	}
+	for(auto &guarded : regexes)
+	{
+		if(guarded.prefix.length() > length || memcmp(name, guarded.prefix.data(), guarded.prefix.length()) != 0)
+		{
+			continue;
+		}
+		if(guarded.suffix.length() > length || memcmp(name + length - guarded.suffix.length(), guarded.suffix.data(), guarded.suffix.length()) != 0)
+		{
+			continue;
+		}
+		if(std::regex_search(target.begin(), target.end(), guarded.regex))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// The built-in tables never change, so instead of going through
+// PatternMatcher at startup they are compiled along with the program.  Each
+// pattern is parsed by the compiler into a BuiltinRule, and the rules are
+// indexed by the first character a name must have, or the last for rules
+// only anchored at the end, so that a name is only checked against the few
+// rules that could match it.  Only as much of ECMAScript is understood as the
+// tables use:
+//
+//	[^] part [.* part] [$]
+//
+// where a part is literal characters and '.' wildcards, with at most one
+// group of literal alternatives such as "\.(jar|cab|zip)", and ".*" is only
+// allowed between the two anchors.  A pattern beyond that fails the build,
+// rather than quietly being matched differently from std::regex.
+struct BuiltinLiteral
+{
+	static const size_t maxLength = 32;
+
+	char text[maxLength] = {};	// Case-folded, with 0 standing for a '.' wildcard
+	size_t length = 0;
+};
+
+struct BuiltinRule
+{
+	static const size_t maxAlternatives = 8;
+
+	// The alternatives one end of the pattern allows
+	struct Part
+	{
+		BuiltinLiteral alternatives[maxAlternatives];
+		size_t count = 0;
+	};
+
+	bool anchoredStart = false;
+	bool anchoredEnd = false;
+	bool gap = false;	// ".*" between head and tail
+	Part head;
+	Part tail;
+
+	bool matches(std::string_view name) const;
+	bool occursAt(std::string_view name, size_t position) const;
+};
+
+// strchr() and isalnum() for the compiler
+constexpr bool isOneOf(char c, const char *set)
+{
+	while(*set && *set != c)
+	{
+		set++;
+	}
+	return c && *set;
+}
+
+constexpr bool isEscapable(char c)
+{
+	return c && !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'));
+}
+
+constexpr void appendBuiltinChar(BuiltinRule::Part &part, char c)
+{
+	for(size_t i = 0; i < part.count; i++)
+	{
+		BuiltinLiteral &literal = part.alternatives[i];
+		if(literal.length == BuiltinLiteral::maxLength)
+		{
+			throw std::logic_error("Built-in pattern literal is too long");
+		}
+		literal.text[literal.length++] = c;
+	}
+}
+
+// Parse one part of a pattern from "i", stopping at the end, at ".*", or at a
+// final '$', which sets "anchoredEnd"
+constexpr BuiltinRule::Part parseBuiltinPart(const char *pattern, size_t &i, bool &anchoredEnd)
+{
+	BuiltinRule::Part part;
+	part.count = 1;
+	bool grouped = false;
+	while(pattern[i] && !(pattern[i] == '.' && pattern[i+1] == '*'))
+	{
+		char c = pattern[i++];
+		if(c == '$' && !pattern[i])
+		{
+			anchoredEnd = true;
+		}
+		else if(c == '(' && !grouped && part.count == 1)
+		{
+			// Every alternative starts with what came before the group
+			BuiltinLiteral before = part.alternatives[0];
+			part.count = 0;
+			grouped = true;
+			while(true)
+			{
+				if(part.count == BuiltinRule::maxAlternatives)
+				{
+					throw std::logic_error("Built-in pattern has too many alternatives");
+				}
+				part.alternatives[part.count++] = before;
+				BuiltinRule::Part alternative;
+				alternative.count = 1;
+				while(pattern[i] && !isOneOf(pattern[i], "|)"))
+				{
+					char d = pattern[i++];
+					if(d == '\\' && isEscapable(pattern[i]))
+					{
+						appendBuiltinChar(alternative, foldCase(pattern[i++]));
+					}
+					else if(d == '.' && pattern[i] != '*')
+					{
+						appendBuiltinChar(alternative, 0);
+					}
+					else if(isOneOf(d, "\\^$.*+?{}()[]"))
+					{
+						throw std::logic_error("Built-in pattern group uses more than literals");
+					}
+					else
+					{
+						appendBuiltinChar(alternative, foldCase(d));
+					}
+				}
+				BuiltinLiteral &current = part.alternatives[part.count - 1];
+				for(size_t j = 0; j < alternative.alternatives[0].length; j++)
+				{
+					if(current.length == BuiltinLiteral::maxLength)
+					{
+						throw std::logic_error("Built-in pattern literal is too long");
+					}
+					current.text[current.length++] = alternative.alternatives[0].text[j];
+				}
+				if(!pattern[i])
+				{
+					throw std::logic_error("Built-in pattern has an unterminated group");
+				}
+				if(pattern[i++] == ')')
+				{
+					break;
+				}
+			}
+		}
+		else if(c == '\\' && isEscapable(pattern[i]))
+		{
+			appendBuiltinChar(part, foldCase(pattern[i++]));
+		}
+		else if(c == '.')
+		{
+			appendBuiltinChar(part, 0);
+		}
+		else if(isOneOf(c, "\\^$*+?{}()[]|"))
+		{
+			throw std::logic_error("Built-in pattern uses more than literals, wildcards and one group");
+		}
+		else
+		{
+			appendBuiltinChar(part, foldCase(c));
+		}
+	}
+	for(size_t j = 0; j < part.count; j++)
+	{
+		if(part.alternatives[j].length == 0)
+		{
+			throw std::logic_error("Built-in pattern needs literal text at each end");
+		}
+	}
+	return part;
+}
+
+constexpr BuiltinRule parseBuiltinPattern(const char *pattern)
+{
+	BuiltinRule rule;
+	size_t i = 0;
+	if(pattern[0] == '^')
+	{
+		rule.anchoredStart = true;
+		i++;
+	}
+	rule.head = parseBuiltinPart(pattern, i, rule.anchoredEnd);
+	if(pattern[i])
+	{
+		i += 2;
+		rule.gap = true;
+		rule.tail = parseBuiltinPart(pattern, i, rule.anchoredEnd);
+		if(pattern[i] || !rule.anchoredStart || !rule.anchoredEnd)
+		{
+			throw std::logic_error("Built-in pattern has \".*\" other than between '^' and '$'");
+		}
+	}
+	return rule;
+}
+
+// Whether a case-folded literal matches the name at "position", which must
+// leave room for it
+static inline bool literalAt(const BuiltinLiteral &literal, std::string_view name, size_t position)
+{
+	for(size_t i = 0; i < literal.length; i++)
+	{
+		unsigned char c = name[position + i];
+		if(literal.text[i] ? foldCase(c) != (unsigned char)literal.text[i] : isLineTerminator(c))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BuiltinRule::matches(std::string_view name) const
+{
+	size_t length = name.length();
+	if(!anchoredStart && !anchoredEnd)
+	{
+		for(size_t position = 0; position < length; position++)
+		{
+			if(occursAt(name, position))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+	for(size_t i = 0; i < head.count; i++)
+	{
+		const BuiltinLiteral &start = head.alternatives[i];
+		if(length < start.length)
+		{
+			continue;
+		}
+		if(gap)
+		{
+			if(!literalAt(start, name, 0))
+			{
+				continue;
+			}
+			for(size_t j = 0; j < tail.count; j++)
+			{
+				const BuiltinLiteral &end = tail.alternatives[j];
+				if(length < start.length + end.length || !literalAt(end, name, length - end.length))
+				{
+					continue;
+				}
+				// ".*" doesn't match line terminators either
+				size_t k = start.length;
+				while(k < length - end.length && !isLineTerminator(name[k]))
+				{
+					k++;
+				}
+				if(k == length - end.length)
+				{
+					return true;
+				}
+			}
+		}
+		else if(anchoredStart)
+		{
+			if((!anchoredEnd || length == start.length) && literalAt(start, name, 0))
+			{
+				return true;
+			}
+		}
+		else if(literalAt(start, name, length - start.length))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whether an unanchored rule matches the name at "position"
+bool BuiltinRule::occursAt(std::string_view name, size_t position) const
+{
+	for(size_t i = 0; i < head.count; i++)
+	{
+		const BuiltinLiteral &literal = head.alternatives[i];
+		if(position + literal.length <= name.length() && literalAt(literal, name, position))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// A built-in table of up to 64 patterns, compiled by the compiler.  Rules
+// anchored at the start are listed under every first and second character
+// they accept, in either case, and those anchored only at the end under
+// every last character, so a name only has to be checked against the rules
+// whose ends it shares.  The unanchored ones are listed under their first
+// character, and found in a single pass over the name.
+template<size_t N>
+class BuiltinMatcher
+{
+public:
+	constexpr explicit BuiltinMatcher(const char *const (&patterns)[N])
+	{
+		static_assert(N <= 64, "Built-in tables are limited to 64 patterns");
+		for(size_t i = 0; i < N; i++)
+		{
+			rules[i] = parseBuiltinPattern(patterns[i]);
+			const BuiltinRule &rule = rules[i];
+			uint64_t bit = uint64_t(1) << i;
+			for(size_t j = 0; j < rule.head.count; j++)
+			{
+				const BuiltinLiteral &literal = rule.head.alternatives[j];
+				if(rule.anchoredStart)
+				{
+					list(byFirst, literal.text[0], bit);
+					if(literal.length > 1)
+					{
+						list(bySecond, literal.text[1], bit);
+					}
+					else
+					{
+						oneCharacter |= bit;
+						list(bySecond, 0, bit);
+					}
+				}
+				else if(rule.anchoredEnd)
+				{
+					list(byLast, literal.text[literal.length - 1], bit);
+				}
+				else
+				{
+					list(byAnywhere, literal.text[0], bit);
+					unanchored |= bit;
+				}
+			}
+		}
+	}
+
+	bool match(std::string_view name) const
+	{
+		size_t length = name.length();
+		if(length == 0)
+		{
+			return false;
+		}
+		const unsigned char *bytes = (const unsigned char *)name.data();
+		uint64_t candidates = byFirst[bytes[0]] & (length > 1 ? bySecond[bytes[1]] : oneCharacter);
+		candidates |= byLast[bytes[length - 1]];
+		while(candidates)
+		{
+			if(rules[__builtin_ctzll(candidates)].matches(name))
+			{
+				return true;
+			}
+			candidates &= candidates - 1;
+		}
+		for(size_t position = 0; unanchored && position < length; position++)
+		{
+			for(uint64_t starting = byAnywhere[bytes[position]]; starting; starting &= starting - 1)
+			{
+				if(rules[__builtin_ctzll(starting)].occursAt(name, position))
+				{
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+private:
+	// List a rule under the bytes that fold to "c", or under any byte but a
+	// line terminator for a wildcard
+	static constexpr void list(uint64_t *index, char c, uint64_t bit)
+	{
+		for(int k = 0; k < 256; k++)
+		{
+			if(c ? foldCase(k) == (unsigned char)c : !isLineTerminator(k))
+			{
+				index[k] |= bit;
+			}
+		}
+	}
+
+	BuiltinRule rules[N] = {};
+	uint64_t byFirst[256] = {};
+	uint64_t bySecond[256] = {};
+	uint64_t byLast[256] = {};
+	uint64_t byAnywhere[256] = {};
+	uint64_t oneCharacter = 0;	// Rules a single character could match
+	uint64_t unanchored = 0;
+};
+
+// A built-in table as strings, for the manifest's rules
+template<size_t N>
+std::vector<std::string> patternList(const char *const (&patterns)[N])
+{
+	return std::vector<std::string>(patterns, patterns + N);
+}
+
 // Directories to include wholesale in the archive
-std::vector<std::string> cacheDirs = {
+constexpr const char *cacheDirs[] = {
 	"^.jagex_cache_32$",
 	"^.file_store_32$",
 	"^jagexcache$",
@@ -65,353 +1411,6305 @@ std::vector<std::string> cacheDirs = {
 	"^cache-93423-17382-59373-28323$",
 };
 
-std::vector<std::regex> cacheDirRegexes;
+constexpr BuiltinMatcher<std::size(cacheDirs)> cacheDirRegexes(cacheDirs);
+
+// Directories to include if their parent is in cacheDirParents
+constexpr const char *parentedCacheDirs[] = {
+	"^live$",
+	"^live_beta$",
+};
+
+constexpr const char *cacheDirParents[] = {
+	"^oldschool$",
+	"^runescape$",
+};
+
+constexpr BuiltinMatcher<std::size(parentedCacheDirs)> parentedCacheDirRegexes(parentedCacheDirs);
+constexpr BuiltinMatcher<std::size(cacheDirParents)> cacheDirParentRegexes(cacheDirParents);
+
+// Directory trees to exclude because they are known to produce false positives
+std::vector<std::string> cacheExcludeDirs = {
+	"^planeshift$",
+};
+
+PatternMatcher cacheExcludeRegexes;
+
+// Directory trees that never hold caches, skipped without even being opened.
+// A name starting with '/' is a path relative to the search path; any other
+// is a directory name anywhere in the tree.  Being exact, they're checked by
+// hash lookup rather than pattern matching.  Extended with --prune.
+std::vector<std::string> pruneDirs = {
+	".git",
+	".hg",
+	".svn",
+	"node_modules",
+	"__pycache__",
+	".mozilla",
+	"google-chrome",
+	"chromium",
+	"/proc",
+	"/sys",
+	"/dev",
+	"/run",
+	"/boot",
+	"/usr/include",
+	"/usr/share",
+	"/usr/src",
+	"/usr/lib/modules",
+	"/lib/modules",
+};
+
+// Views into pruneDirs, which doesn't change once the scan starts, so that
+// entry names can be looked up without being copied
+std::unordered_set<std::string_view> pruneNames;
+std::unordered_set<std::string> prunePaths;
+
+// Whether to stay on the search path's filesystem, for --one-file-system
+int gOneFileSystem = 0;
+
+// How far ahead of the archive writer --prefetch asks for files to be read,
+// in bytes, or 0 not to prefetch at all
+uint64_t gPrefetchBytes = 0;
+
+constexpr const char *cachePatterns[] = {
+	"^code\\.dat$",
+	"^jingle0\\.mid$",
+	"^jingle1\\.mid$",
+	"^jingle2\\.mid$",
+	"^jingle3\\.mid$",
+	"^jingle4\\.mid$",
+	"^shared_game_unpacker\\.dat$",
+	"^worldmap\\.dat$",
+
+	"^1jfds",
+	"^94jfj",
+	"^a2155",
+	"^cht3f",
+	"^g34zx",
+	"^k23lk",
+	"^k4o2n",
+	"^lam3n",
+	"^mn24j",
+	"^plam3",
+	"^zck35",
+	"^zko34",
+	"^zl3kp",
+	"^zn12n",
+	"^24623168",
+	"^37966926",
+	"^236861982",
+	"^929793776",
+	"^60085811638",
+	"^1913169001452",
+	"^32993056653417",
+	"^3305336302107891869",
+	"^main_file_cache.",
+
+	"\\.jag$",
+
+	"^loader.*\\.(jar|cab|zip)$",
+	"^mapview.*\\.(jar|cab|zip)$",
+	"^runescape.*\\.(jar|cab|zip)$",
+	"^loginapplet.*\\.(jar|cab|zip)$",
+	"^jag.*\\.dll$",
+	"^(entity|land|maps|sounds).*\\.mem$",
+	
+	"mudclient",
+	"\\.jag-",
+	"\\.mem-",
+};
+
+constexpr BuiltinMatcher<std::size(cachePatterns)> cacheRegexes(cachePatterns);
+
+std::vector<std::string> maskPaths;
+PatternMatcher maskPathRegexes;
+
+// Return true if any pattern matches the target string
+template<typename Matcher>
+bool searchRegexes(std::string_view target, const Matcher &regexes)
+{
+	Profile::Timer timer(Profile::Classify);
+	return regexes.match(target);
+}
+
+// The last component of a path, without making a copy.  Unlike filename(),
+// trailing slashes are ignored, so that "tree/" gives "tree" as the name of
+// the directory its entries are in.
+std::string_view lastComponent(std::string_view path)
+{
+	while(path.size() > 1 && path.back() == '/')
+	{
+		path.remove_suffix(1);
+	}
+	size_t slash = path.rfind('/');
+	return (slash == std::string_view::npos) ? path : path.substr(slash + 1);
+}
+
+// Whether a directory called "name", in a directory called "parent", is a
+// cache directory.  "parent" is empty for a directory with no parent.
+bool isCacheDir(std::string_view name, std::string_view parent, [[maybe_unused]]int verbose)
+{
+	bool isCache = searchRegexes(name, cacheDirRegexes);
+	if(!isCache)
+	{
+		if(searchRegexes(name, parentedCacheDirRegexes) &&
+		   !parent.empty() &&
+		   searchRegexes(parent, cacheDirParentRegexes))
+		{
+			isCache = true;
+		}
+	}
+	return isCache;
+}
+
+// Tells which of a list of patterns matched, for the manifest.  Each pattern
+// gets a matcher of its own, so rules are only built when a manifest is.
+class RuleFinder
+{
+public:
+	RuleFinder() = default;
+	explicit RuleFinder(const std::vector<std::string> &patterns) : patterns(patterns)
+	{
+		for(auto &pattern : patterns)
+		{
+			matchers.emplace_back(std::vector<std::string>{pattern});
+		}
+	}
+
+	// The first pattern matching "name", or nullptr
+	const char *find(std::string_view name) const
+	{
+		for(size_t i = 0; i < matchers.size(); i++)
+		{
+			if(matchers[i].match(name))
+			{
+				return patterns[i].c_str();
+			}
+		}
+		return nullptr;
+	}
+
+private:
+	std::vector<std::string> patterns;
+	std::vector<PatternMatcher> matchers;
+};
+
+RuleFinder cacheRules, cacheDirRules, parentedCacheDirRules, cacheDirParentRules;
+
+// Describe the rule that picked a file to be archived: the cache directory
+// pattern its directory matched, or else the cache file pattern its name did
+std::string describeRule(const std::filesystem::path &source)
+{
+	std::filesystem::path dir = source.parent_path();
+	std::string name = dir.filename().string();
+	if(const char *rule = cacheDirRules.find(name))
+	{
+		return std::string("dir ") + rule;
+	}
+	const char *parented = parentedCacheDirRules.find(name);
+	const char *parent = dir.has_parent_path() ? cacheDirParentRules.find(dir.parent_path().filename().string()) : nullptr;
+	if(parented && parent)
+	{
+		return std::string("dir ") + parent + "/" + parented;
+	}
+	const char *rule = cacheRules.find(source.filename().string());
+	return rule ? rule : "";
+}
+
+// A compressed stream wrapped around the output tarball.  write() takes a copy
+// of the data and returns straight away, so that compression overlaps with
+// scanning and reading; the compressed stream is written to the sink in order
+// by the compressor's own threads.
+class Compressor
+{
+public:
+	enum Format
+	{
+		None,
+		Gzip,
+		Zstd,
+	};
+
+	virtual ~Compressor() {}
+
+	virtual void write(const unsigned char *data, size_t length) = 0;
+
+	// Wait until everything written so far has reached the sink
+	virtual void flush() = 0;
+
+	// End the compressed stream
+	virtual void finish() = 0;
+};
+
+// The output tarball.  Everything written goes through one large, reusable
+// buffer aligned for O_DIRECT, and with --direct-io reaches the disk only in
+// whole aligned blocks, so that a 200 GB scan doesn't push everything else on
+// the machine out of the page cache.
+//
+// How often buffered data is pushed to the kernel, and whether it is synced
+// to disk, is set by the flush policy.  Since a write error may only show up
+// some files later, any failure is reported from whichever call hits it and
+// every call after that throws too.
+class OutputFile
+{
+public:
+	enum FlushPolicy
+	{
+		FlushEachFile,	// Flush after every archived file ("safe")
+		FlushNever,	// Only write when the buffer fills up
+		FlushPeriodic,	// Flush and fdatasync() every syncInterval bytes
+		FlushAtEnd,	// Only write when the buffer fills, fsync() at close
+	};
+
+	OutputFile(int fd, bool directIO, FlushPolicy policy = FlushEachFile, off_t syncInterval = 0);
+	~OutputFile();
+
+	void write(const void *data, size_t length);
+	void writeZeros(size_t length);
+
+	// Space at the end of the buffer for the caller to fill in directly,
+	// flushing first if there is none.  "length" is reduced to the space
+	// available; commit() however much was actually filled.
+	unsigned char *reserve(size_t &length);
+	void commit(size_t length);
+
+	// Space for exactly "length" bytes in one piece, which must be no more
+	// than half the buffer, flushing first if there isn't enough
+	unsigned char *reserveWhole(size_t length);
+
+	// Hand everything buffered so far to the kernel.  With O_DIRECT this
+	// stops at the last aligned block; the remainder stays buffered until
+	// more data arrives or the file is closed.
+	void flush();
+
+	// Called after each archived file to apply the flush policy
+	void fileDone();
+
+	// The output descriptor, for copying file contents straight into it,
+	// or -1 if that isn't possible.  Flushes first.
+	int kernelFd();
+
+	// Compress everything written from now on.  The descriptor moves to
+	// an inner, uncompressed OutputFile that the compressor writes to.
+	void compress(Compressor::Format format, int level, int threads);
+
+	// Send "request", the head of an HTTP PUT, and frame everything written
+	// after it with chunked transfer encoding, since the length of the
+	// archive isn't known until it's done.  close() ends the body and
+	// fails unless the server accepts it.  Call before compress().
+	void upload(const std::string &request);
+
+	// Make everything written so far durable and return the length of the
+	// file, for a checkpoint.  A compressed stream is ended first, so the
+	// file is whole as it stands, and carries on in a new gzip member or
+	// zstd frame, which decompressors read straight on into.
+	off_t checkpoint();
+
+	// Carry on an archive from a checkpoint: cut the file back to
+	// "length" and write on from there.  Call before compress().
+	void resume(off_t length);
+
+	void close();
+
+	static const size_t bufferSize = 1024 * 1024;
+	static const size_t alignment = 4096;
+
+private:
+	void writeOut(size_t length);
+	void writeCompressed(const unsigned char *data, size_t length);
+	void writeRaw(const void *data, size_t length);
+	void endUpload();
+	void startCompressor();
+	void sync(bool metadata);
+	void checkFailed();
+
+	int fd;
+	bool directIO;
+	bool chunked = false;
+	FlushPolicy policy;
+	off_t syncInterval;
+	off_t unsynced = 0;	// Bytes handed to the kernel since the last sync
+	bool failed = false;
+	unsigned char *buffer = nullptr;
+	size_t used = 0;
+
+	std::unique_ptr<OutputFile> sink;
+	std::unique_ptr<Compressor> compressor;
+	Compressor::Format compression = Compressor::None;
+	int compressLevel = 0;
+	int compressThreads = 0;
+};
+
+OutputFile::OutputFile(int fd, bool directIO, FlushPolicy policy, off_t syncInterval) : fd(fd), directIO(directIO), policy(policy), syncInterval(syncInterval)
+{
+	void *memory = nullptr;
+	if(posix_memalign(&memory, alignment, bufferSize) != 0)
+	{
+		throw std::bad_alloc();
+	}
+	buffer = (unsigned char *)memory;
+}
+
+OutputFile::~OutputFile()
+{
+	// Stop the compressor's threads before the sink they write to goes
+	compressor.reset();
+	if(fd != -1)
+	{
+		::close(fd);
+	}
+	free(buffer);
+}
+
+void OutputFile::write(const void *data, size_t length)
+{
+	const unsigned char *source = (const unsigned char *)data;
+	if(compressor && length >= bufferSize / 4)
+	{
+		// The compressor takes a copy of its own anyway, so big writes
+		// skip the buffer once what's already in it has gone ahead
+		checkFailed();
+		writeOut(used);
+		writeCompressed(source, length);
+		return;
+	}
+	while(length > 0)
+	{
+		size_t chunk = length;
+		unsigned char *dest = reserve(chunk);
+		memcpy(dest, source, chunk);
+		commit(chunk);
+		source += chunk;
+		length -= chunk;
+	}
+}
+
+void OutputFile::writeZeros(size_t length)
+{
+	while(length > 0)
+	{
+		size_t chunk = length;
+		unsigned char *dest = reserve(chunk);
+		memset(dest, 0, chunk);
+		commit(chunk);
+		length -= chunk;
+	}
+}
+
+unsigned char *OutputFile::reserve(size_t &length)
+{
+	checkFailed();
+	if(used == bufferSize)
+	{
+		writeOut(bufferSize);
+	}
+	length = std::min(length, bufferSize - used);
+	return buffer + used;
+}
+
+void OutputFile::commit(size_t length)
+{
+	used += length;
+}
+
+unsigned char *OutputFile::reserveWhole(size_t length)
+{
+	checkFailed();
+	if(bufferSize - used < length)
+	{
+		writeOut(directIO ? used - used % alignment : used);
+	}
+	return buffer + used;
+}
+
+void OutputFile::flush()
+{
+	checkFailed();
+	writeOut(directIO ? used - used % alignment : used);
+	if(compressor)
+	{
+		compressor->flush();
+		sink->flush();
+	}
+}
+
+void OutputFile::fileDone()
+{
+	if(policy == FlushEachFile)
+	{
+		flush();
+	}
+	else if(policy == FlushPeriodic && unsynced + (off_t)used >= syncInterval)
+	{
+		flush();
+		sync(false);
+	}
+}
+
+void OutputFile::sync(bool metadata)
+{
+	if(sink)
+	{
+		sink->sync(metadata);
+		unsynced = 0;
+		return;
+	}
+	Profile::Timer timer(Profile::Flush);
+	if((metadata ? fsync(fd) : fdatasync(fd)) != 0 && errno != EINVAL && errno != EROFS)
+	{
+		// EINVAL and EROFS are a pipe or socket, with nothing to sync
+		failed = true;
+		fprintf(stderr, "Error %s syncing archive to disk\n", strerror(errno));
+		throw std::runtime_error("Error writing to output file");
+	}
+	unsynced = 0;
+}
+
+void OutputFile::checkFailed()
+{
+	if(failed)
+	{
+		throw std::runtime_error("Error writing to output file");
+	}
+}
+
+int OutputFile::kernelFd()
+{
+	// The kernel's copy would leave the file offset unaligned, or skip the
+	// compressor or the chunk framing entirely
+	if(directIO || compressor || chunked)
+	{
+		return -1;
+	}
+	flush();
+	return fd;
+}
+
+off_t OutputFile::checkpoint()
+{
+	checkFailed();
+	if(compressor)
+	{
+		writeOut(used);
+		compressor->finish();
+		compressor.reset();
+		off_t length = sink->checkpoint();
+		startCompressor();
+		return length;
+	}
+	flush();
+	off_t length = lseek(fd, 0, SEEK_CUR);
+	if(length == -1)
+	{
+		failed = true;
+		fprintf(stderr, "Error %s finding the end of the archive\n", strerror(errno));
+		throw std::runtime_error("Error writing to output file");
+	}
+	if(used > 0)
+	{
+		// The tail O_DIRECT can't write yet goes out through the page
+		// cache, leaving the file offset where it was, and is written
+		// again once the rest of its block is
+		int flags = fcntl(fd, F_GETFL);
+		bool written = flags != -1 && fcntl(fd, F_SETFL, flags & ~O_DIRECT) != -1 && (ssize_t)used == pwrite(fd, buffer, used, length);
+		if(!written || fcntl(fd, F_SETFL, flags) == -1)
+		{
+			failed = true;
+			fprintf(stderr, "Error %s writing archive for checkpoint\n", strerror(errno));
+			throw std::runtime_error("Error writing to output file");
+		}
+	}
+	sync(false);
+	return length + used;
+}
+
+void OutputFile::resume(off_t length)
+{
+	// With O_DIRECT writing carries on from the start of the last block,
+	// which is read back into the buffer
+	off_t start = directIO ? length - length % alignment : length;
+	used = length - start;
+	struct stat statbuf;
+	if(0 != fstat(fd, &statbuf) || statbuf.st_size < length)
+	{
+		failed = true;
+		fprintf(stderr, "Error: the archive is shorter than its checkpoint\n");
+		throw std::runtime_error("Error resuming output file");
+	}
+	if(0 != ftruncate(fd, length) || (used > 0 && (ssize_t)used != pread(fd, buffer, directIO ? alignment : used, start)) || start != lseek(fd, start, SEEK_SET))
+	{
+		failed = true;
+		fprintf(stderr, "Error %s cutting the archive back to its checkpoint\n", strerror(errno));
+		throw std::runtime_error("Error resuming output file");
+	}
+}
+
+void OutputFile::close()
+{
+	checkFailed();
+	if(compressor)
+	{
+		writeOut(used);
+		compressor->finish();
+		compressor.reset();
+		if(policy == FlushAtEnd || policy == FlushPeriodic)
+		{
+			sink->sync(true);
+		}
+		sink->close();
+		return;
+	}
+	if(directIO && used % alignment != 0)
+	{
+		// The tail can't be written with O_DIRECT
+		flush();
+		directIO = false;
+		int flags = fcntl(fd, F_GETFL);
+		if(flags == -1 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1)
+		{
+			failed = true;
+			fprintf(stderr, "Error %s turning off direct I/O for final write\n", strerror(errno));
+			throw std::runtime_error("Error writing to output file");
+		}
+	}
+	flush();
+	if(policy == FlushAtEnd || policy == FlushPeriodic)
+	{
+		sync(true);
+	}
+	if(chunked)
+	{
+		endUpload();
+	}
+	int result = ::close(fd);
+	fd = -1;
+	if(result != 0)
+	{
+		failed = true;
+		fprintf(stderr, "Error %s closing archive\n", strerror(errno));
+		throw std::runtime_error("Error writing to output file");
+	}
+}
+
+// Write the first "length" bytes of the buffer and move anything after them
+// to the front
+void OutputFile::writeOut(size_t length)
+{
+	if(compressor)
+	{
+		writeCompressed(buffer, length);
+	}
+	else if(length > 0)
+	{
+		// An empty chunk would end the upload
+		char header[20];
+		if(chunked)
+		{
+			writeRaw(header, snprintf(header, sizeof(header), "%zx\r\n", length));
+		}
+		writeRaw(buffer, length);
+		if(chunked)
+		{
+			writeRaw("\r\n", 2);
+		}
+	}
+	memmove(buffer, buffer + length, used - length);
+	used -= length;
+	unsynced += length;
+}
+
+void OutputFile::writeCompressed(const unsigned char *data, size_t length)
+{
+	Profile::Timer timer(Profile::WriteTar);
+	try
+	{
+		compressor->write(data, length);
+	}
+	catch(std::exception &e)
+	{
+		failed = true;
+		throw;
+	}
+}
+
+void OutputFile::writeRaw(const void *data, size_t length)
+{
+	Profile::Timer timer(Profile::WriteTar);
+	size_t written = 0;
+	while(written < length)
+	{
+		ssize_t result = ::write(fd, (const char *)data + written, length - written);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result <= 0)
+		{
+			failed = true;
+			fprintf(stderr, "Write error %s when adding to archive\n", strerror(errno));
+			throw std::runtime_error("Error writing to output file");
+		}
+		written += result;
+		Stats::add(Stats::BytesWritten, result);
+	}
+}
+
+void OutputFile::upload(const std::string &request)
+{
+	writeRaw(request.data(), request.size());
+	chunked = true;
+}
+
+// Send the last, empty chunk and read the server's reply, skipping any
+// interim 1xx responses
+void OutputFile::endUpload()
+{
+	writeRaw("0\r\n\r\n", 5);
+	std::string reply;
+	char data[4096];
+	while(true)
+	{
+		size_t end = reply.find("\r\n\r\n");
+		if(end != std::string::npos)
+		{
+			int status = 0;
+			if(reply.compare(0, 5, "HTTP/") != 0 || sscanf(reply.c_str(), "HTTP/%*s %d", &status) != 1)
+			{
+				break;
+			}
+			if(status >= 100 && status < 200)
+			{
+				reply.erase(0, end + 4);
+				continue;
+			}
+			if(status >= 200 && status < 300)
+			{
+				return;
+			}
+			failed = true;
+			reply.resize(reply.find("\r\n"));
+			fprintf(stderr, "Error: upload rejected with %s\n", reply.c_str());
+			throw std::runtime_error("Error writing to output file");
+		}
+		ssize_t result = ::read(fd, data, sizeof(data));
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result < 0)
+		{
+			failed = true;
+			fprintf(stderr, "Error %s reading reply to upload\n", strerror(errno));
+			throw std::runtime_error("Error writing to output file");
+		}
+		if(result == 0)
+		{
+			break;
+		}
+		reply.append(data, result);
+	}
+	failed = true;
+	fprintf(stderr, "Error: no HTTP reply to upload\n");
+	throw std::runtime_error("Error writing to output file");
+}
+
+// pigz-style parallel gzip.  The stream is cut into blocks that are deflated
+// independently on a pool of threads, each primed with the last 32 KiB of the
+// block before it so the compression ratio barely suffers.  Every block but
+// the last ends with a sync flush, which leaves it byte-aligned, so the
+// compressed blocks can simply be concatenated in order; their CRCs are
+// combined for the gzip trailer.
+class GzipCompressor : public Compressor
+{
+public:
+	GzipCompressor(OutputFile &sink, int level, int threads);
+	~GzipCompressor();
+
+	void write(const unsigned char *data, size_t length) override;
+	void flush() override;
+	void finish() override;
+
+private:
+	struct Block
+	{
+		std::vector<unsigned char> input;
+		std::vector<unsigned char> dictionary;
+		std::vector<unsigned char> output;
+		uLong crc = 0;
+		bool last = false;
+		bool done = false;
+	};
+
+	void submit(bool last);
+	void drain(std::unique_lock<std::mutex> &guard);
+	void stop();
+	void compressBlocks();
+	void writeBlocks();
+
+	OutputFile &sink;
+	int level;
+
+	std::vector<unsigned char> current;
+	std::vector<unsigned char> dictionary;
+	uLong crc;
+	uLong totalLength = 0;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::shared_ptr<Block>> toCompress;
+	std::deque<std::shared_ptr<Block>> toWrite;	// In stream order
+	size_t maxBlocks;
+	bool stopping = false;
+	std::exception_ptr error;
+	std::vector<std::thread> workers;
+	std::thread writer;
+
+	static const size_t blockSize = 128 * 1024;
+	static const size_t windowSize = 32 * 1024;
+};
+
+GzipCompressor::GzipCompressor(OutputFile &sink, int level, int threads) : sink(sink), level(level), crc(crc32(0, Z_NULL, 0)), maxBlocks(threads * 2 + 2)
+{
+	// Fixed header: no filename, no timestamp, so output is reproducible
+	static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+	sink.write(header, sizeof(header));
+	current.reserve(blockSize);
+
+	for(int i = 0; i < threads; i++)
+	{
+		workers.emplace_back(&GzipCompressor::compressBlocks, this);
+	}
+	writer = std::thread(&GzipCompressor::writeBlocks, this);
+}
+
+GzipCompressor::~GzipCompressor()
+{
+	stop();
+}
+
+void GzipCompressor::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for(auto &worker : workers)
+	{
+		if(worker.joinable())
+		{
+			worker.join();
+		}
+	}
+	if(writer.joinable())
+	{
+		writer.join();
+	}
+}
+
+void GzipCompressor::write(const unsigned char *data, size_t length)
+{
+	while(length > 0)
+	{
+		size_t chunk = std::min(length, blockSize - current.size());
+		current.insert(current.end(), data, data + chunk);
+		data += chunk;
+		length -= chunk;
+		if(current.size() == blockSize)
+		{
+			submit(false);
+		}
+	}
+}
+
+void GzipCompressor::flush()
+{
+	if(!current.empty())
+	{
+		submit(false);
+	}
+	std::unique_lock<std::mutex> guard(lock);
+	drain(guard);
+}
+
+void GzipCompressor::finish()
+{
+	submit(true);
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		drain(guard);
+	}
+	stop();
+
+	unsigned char trailer[8];
+	for(int i = 0; i < 4; i++)
+	{
+		trailer[i] = (crc >> (8 * i)) & 0xff;
+		trailer[4 + i] = (totalLength >> (8 * i)) & 0xff;
+	}
+	sink.write(trailer, sizeof(trailer));
+}
+
+// Wait until every block handed over so far has been written
+void GzipCompressor::drain(std::unique_lock<std::mutex> &guard)
+{
+	wake.wait(guard, [this]{ return toWrite.empty() || error; });
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+// Hand the current block to the compression threads
+void GzipCompressor::submit(bool last)
+{
+	auto block = std::make_shared<Block>();
+	block->input.swap(current);
+	block->dictionary = dictionary;
+	block->last = last;
+	current.reserve(blockSize);
+
+	// The next block's dictionary is the last 32 KiB of everything so far
+	dictionary.insert(dictionary.end(), block->input.begin(), block->input.end());
+	if(dictionary.size() > windowSize)
+	{
+		dictionary.erase(dictionary.begin(), dictionary.end() - windowSize);
+	}
+
+	std::unique_lock<std::mutex> guard(lock);
+	wake.wait(guard, [this]{ return toWrite.size() < maxBlocks || error; });
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+	toCompress.push_back(block);
+	toWrite.push_back(block);
+	wake.notify_all();
+}
+
+void GzipCompressor::compressBlocks()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		wake.wait(guard, [this]{ return !toCompress.empty() || stopping; });
+		if(toCompress.empty())
+		{
+			break;
+		}
+		std::shared_ptr<Block> block = toCompress.front();
+		toCompress.pop_front();
+		guard.unlock();
+
+		bool ok = false;
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		if(deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+		{
+			ok = block->dictionary.empty() || deflateSetDictionary(&stream, block->dictionary.data(), block->dictionary.size()) == Z_OK;
+			stream.next_in = block->input.data();
+			stream.avail_in = block->input.size();
+			block->output.resize(deflateBound(&stream, block->input.size()) + 16);
+			size_t have = 0;
+			while(ok)
+			{
+				stream.next_out = block->output.data() + have;
+				stream.avail_out = block->output.size() - have;
+				int result = deflate(&stream, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+				have = block->output.size() - stream.avail_out;
+				if(result == Z_STREAM_ERROR)
+				{
+					ok = false;
+				}
+				else if(block->last ? result == Z_STREAM_END : stream.avail_out != 0)
+				{
+					break;
+				}
+				else
+				{
+					block->output.resize(block->output.size() * 2);
+				}
+			}
+			block->output.resize(have);
+			deflateEnd(&stream);
+		}
+		block->crc = crc32(0, block->input.data(), block->input.size());
+
+		guard.lock();
+		if(!ok && !error)
+		{
+			fprintf(stderr, "Error compressing archive\n");
+			error = std::make_exception_ptr(std::runtime_error("Error compressing output"));
+		}
+		block->done = true;
+		wake.notify_all();
+	}
+}
+
+void GzipCompressor::writeBlocks()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		wake.wait(guard, [this]{ return (!toWrite.empty() && toWrite.front()->done) || (stopping && toWrite.empty()) || error; });
+		if(toWrite.empty() || error)
+		{
+			break;
+		}
+		std::shared_ptr<Block> block = toWrite.front();
+		guard.unlock();
+		try
+		{
+			sink.write(block->output.data(), block->output.size());
+		}
+		catch(std::exception &e)
+		{
+			guard.lock();
+			error = std::current_exception();
+			wake.notify_all();
+			break;
+		}
+		crc = crc32_combine(crc, block->crc, block->input.size());
+		totalLength += block->input.size();
+		guard.lock();
+		toWrite.pop_front();
+		wake.notify_all();
+	}
+}
+
+#ifdef HAVE_ZSTD
+// zstd, using the library's own worker threads.  Our one thread feeds the
+// library so that the caller never waits on it.
+class ZstdCompressor : public Compressor
+{
+public:
+	ZstdCompressor(OutputFile &sink, int level, int threads);
+	~ZstdCompressor();
+
+	void write(const unsigned char *data, size_t length) override;
+	void flush() override;
+	void finish() override;
+
+private:
+	struct Chunk
+	{
+		std::vector<unsigned char> data;
+		ZSTD_EndDirective mode;
+	};
+
+	void submit(std::vector<unsigned char> data, ZSTD_EndDirective mode);
+	void compressChunks();
+
+	OutputFile &sink;
+	ZSTD_CCtx *context;
+	std::vector<unsigned char> output;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<Chunk> chunks;
+	bool busy = false;
+	bool stopping = false;
+	std::exception_ptr error;
+	std::thread compressor;
+
+	static const size_t maxChunks = 4;
+};
+
+ZstdCompressor::ZstdCompressor(OutputFile &sink, int level, int threads) : sink(sink), context(ZSTD_createCCtx()), output(ZSTD_CStreamOutSize())
+{
+	if(!context)
+	{
+		throw std::bad_alloc();
+	}
+	ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(context, ZSTD_c_checksumFlag, 1);
+	// Fails harmlessly if the library was built without threads
+	ZSTD_CCtx_setParameter(context, ZSTD_c_nbWorkers, threads);
+	compressor = std::thread(&ZstdCompressor::compressChunks, this);
+}
+
+ZstdCompressor::~ZstdCompressor()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	if(compressor.joinable())
+	{
+		compressor.join();
+	}
+	ZSTD_freeCCtx(context);
+}
+
+void ZstdCompressor::write(const unsigned char *data, size_t length)
+{
+	submit(std::vector<unsigned char>(data, data + length), ZSTD_e_continue);
+}
+
+void ZstdCompressor::flush()
+{
+	submit(std::vector<unsigned char>(), ZSTD_e_flush);
+}
+
+void ZstdCompressor::finish()
+{
+	submit(std::vector<unsigned char>(), ZSTD_e_end);
+}
+
+// Queue a chunk.  Flushes and the end of the stream wait for everything
+// before them to be written.
+void ZstdCompressor::submit(std::vector<unsigned char> data, ZSTD_EndDirective mode)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	wake.wait(guard, [this]{ return chunks.size() < maxChunks || error; });
+	if(!error)
+	{
+		chunks.push_back({std::move(data), mode});
+		wake.notify_all();
+		if(mode != ZSTD_e_continue)
+		{
+			wake.wait(guard, [this]{ return (chunks.empty() && !busy) || error; });
+		}
+	}
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+void ZstdCompressor::compressChunks()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		wake.wait(guard, [this]{ return !chunks.empty() || stopping; });
+		if(chunks.empty())
+		{
+			break;
+		}
+		Chunk chunk = std::move(chunks.front());
+		chunks.pop_front();
+		busy = true;
+		wake.notify_all();
+		guard.unlock();
+
+		try
+		{
+			ZSTD_inBuffer in = {chunk.data.data(), chunk.data.size(), 0};
+			bool more = true;
+			while(more)
+			{
+				ZSTD_outBuffer out = {output.data(), output.size(), 0};
+				size_t remaining = ZSTD_compressStream2(context, &out, &in, chunk.mode);
+				if(ZSTD_isError(remaining))
+				{
+					fprintf(stderr, "Error %s compressing archive\n", ZSTD_getErrorName(remaining));
+					throw std::runtime_error("Error compressing output");
+				}
+				sink.write(output.data(), out.pos);
+				more = (chunk.mode == ZSTD_e_continue) ? (in.pos < in.size) : (remaining != 0);
+			}
+			guard.lock();
+		}
+		catch(std::exception &e)
+		{
+			guard.lock();
+			error = std::current_exception();
+			chunks.clear();
+		}
+		busy = false;
+		wake.notify_all();
+		if(error)
+		{
+			break;
+		}
+	}
+}
+#endif
+
+void OutputFile::compress(Compressor::Format format, int level, int threads)
+{
+	if(format == Compressor::None)
+	{
+		return;
+	}
+	sink = std::make_unique<OutputFile>(fd, directIO, policy, syncInterval);
+	sink->chunked = chunked;
+	fd = -1;
+	directIO = false;
+	chunked = false;
+	compression = format;
+	compressLevel = level;
+	compressThreads = threads;
+	startCompressor();
+}
+
+void OutputFile::startCompressor()
+{
+	if(compression == Compressor::Gzip)
+	{
+		compressor = std::make_unique<GzipCompressor>(*sink, compressLevel, compressThreads);
+	}
+#ifdef HAVE_ZSTD
+	else if(compression == Compressor::Zstd)
+	{
+		compressor = std::make_unique<ZstdCompressor>(*sink, compressLevel, compressThreads);
+	}
+#endif
+}
+
+// Create an archive file that mustn't already exist, or with "resume" open
+// the one there is, with O_DIRECT if "directIO" is set and the filesystem
+// allows it, clearing it if not.  Returns -1 if the file can't be opened,
+// having said why.
+int createOutput(const std::filesystem::path &dest, int &directIO, bool resume = false)
+{
+	// A resumed archive's last block may need reading back
+	int flags = resume ? O_RDWR : O_WRONLY|O_CREAT|O_EXCL;
+	int fd = open(dest.c_str(), flags|(directIO ? O_DIRECT : 0), 0666);
+	if(fd == -1 && directIO && errno == EINVAL)
+	{
+		fprintf(stderr, "Warning: %s does not support direct I/O, continuing without it\n", dest.c_str());
+		directIO = 0;
+		fd = open(dest.c_str(), flags, 0666);
+	}
+	if(fd == -1)
+	{
+		fprintf(stderr, "Error %s opening output file %s\n", strerror(errno), dest.c_str());
+	}
+	return fd;
+}
+
+// Whether the archive goes to a stream rather than a new file: "-" for
+// stdout, tcp://host:port for a plain TCP connection, or http://host[:port]/path
+// for an HTTP PUT
+bool isStreamOutput(const std::string &dest)
+{
+	return dest == "-" || dest.compare(0, 6, "tcp://") == 0 || dest.compare(0, 7, "http://") == 0;
+}
+
+// Open a stream output.  For stdout the archive gets a descriptor of its own
+// and stdout is pointed at stderr, so that --verbose can't end up in the
+// middle of the archive.  For http:// "request" is set to the head of the PUT
+// to send first.  Writes block while the reader is slow, which holds up the
+// whole pipeline behind them.  Returns -1 if the stream can't be opened,
+// having said why.
+int openStreamOutput(const std::string &dest, std::string &request)
+{
+	// A reader going away is reported as a write error, not a silent exit
+	signal(SIGPIPE, SIG_IGN);
+	if(dest == "-")
+	{
+		if(isatty(STDOUT_FILENO))
+		{
+			fprintf(stderr, "Error: Not writing an archive to a terminal\n");
+			return -1;
+		}
+		int fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+		if(fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+		{
+			fprintf(stderr, "Error %s redirecting stdout\n", strerror(errno));
+			return -1;
+		}
+		return fd;
+	}
+	
+	bool http = dest.compare(0, 7, "http://") == 0;
+	size_t start = http ? 7 : 6;
+	size_t slash = dest.find('/', start);
+	std::string authority = dest.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+	std::string target = slash == std::string::npos ? "/" : dest.substr(slash);
+	std::string host = authority, port = http ? "80" : "";
+	size_t colon = authority.rfind(':');
+	if(colon != std::string::npos && authority.find(']', colon) == std::string::npos)
+	{
+		host = authority.substr(0, colon);
+		port = authority.substr(colon + 1);
+	}
+	if(host.size() > 1 && host.front() == '[' && host.back() == ']')
+	{
+		host = host.substr(1, host.size() - 2);
+	}
+	if(host.empty() || port.empty() || (!http && slash != std::string::npos))
+	{
+		fprintf(stderr, "Error: %s should be %s\n", dest.c_str(), http ? "http://host[:port]/path" : "tcp://host:port");
+		return -1;
+	}
+	
+	struct addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addresses;
+	int result = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+	if(result != 0)
+	{
+		fprintf(stderr, "Error %s looking up %s\n", gai_strerror(result), host.c_str());
+		return -1;
+	}
+	int fd = -1;
+	for(struct addrinfo *address = addresses; address; address = address->ai_next)
+	{
+		fd = socket(address->ai_family, address->ai_socktype|SOCK_CLOEXEC, address->ai_protocol);
+		if(fd != -1 && connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+		{
+			break;
+		}
+		if(fd != -1)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	if(fd == -1)
+	{
+		fprintf(stderr, "Error %s connecting to %s\n", strerror(errno), authority.c_str());
+		return -1;
+	}
+	// Notice a peer that has gone away without closing the connection
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	
+	if(http)
+	{
+		request = "PUT " + target + " HTTP/1.1\r\nHost: " + authority + "\r\nUser-Agent: rs-cache-finder-linux\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+	}
+	return fd;
+}
+
+// Files at least this big are copied into the archive by the kernel.  For
+// anything smaller, the extra flush and system calls cost more than they save.
+const off_t kernelCopyThreshold = 16 * 1024;
+
+// Copy up to "size" bytes from "infd" to the end of the archive without
+// passing them through userspace, using copy_file_range() where both files
+// support it and sendfile() otherwise.  Returns the number of bytes copied,
+// which is less than "size" if the file shrank or the kernel can't do this
+// for these two files; the caller copies whatever is left the slow way.
+off_t copyFileKernel(int infd, OutputFile &outfile, off_t size, const std::filesystem::path &source)
+{
+	int outfd = outfile.kernelFd();
+	if(outfd == -1)
+	{
+		return 0;
+	}
+	
+	// The kernel reads and writes in one go; reading is likely the slow part
+	Profile::Timer timer(Profile::ReadFile);
+	off_t copied = 0;
+	bool useCopyFileRange = true;
+	while(copied < size)
+	{
+		ssize_t result;
+		if(useCopyFileRange)
+		{
+			result = copy_file_range(infd, NULL, outfd, NULL, size - copied, 0);
+		}
+		else
+		{
+			result = sendfile(outfd, infd, NULL, size - copied);
+		}
+		if(result > 0)
+		{
+			copied += result;
+			Stats::add(Stats::BytesRead, result);
+			Stats::add(Stats::BytesWritten, result);
+		}
+		else if(result == 0)
+		{
+			break;
+		}
+		else if(errno == EINTR)
+		{
+			continue;
+		}
+		else if(errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)
+		{
+			// Not supported between these two files
+			if(!useCopyFileRange)
+			{
+				break;
+			}
+			useCopyFileRange = false;
+		}
+		else
+		{
+			fprintf(stderr, "Copy error %s for file %s when adding to archive\n", strerror(errno), source.c_str());
+			throw std::runtime_error("Error copying input file");
+		}
+	}
+	return copied;
+}
+
+// Files at least this big that the kernel can't copy into the archive are
+// mapped rather than read, so that the compressor or the hash reads them
+// straight out of the page cache.  Below this, setting up the mapping costs
+// more than the copy it saves.
+const off_t mappedReadThreshold = 1024 * 1024;
+
+// A read-only mapping of the first "size" bytes of a file, for reading once
+// from front to back.  The kernel is asked to read ahead of the cursor, and
+// pages behind it are dropped from the mapping as it moves on, so that a 2 GB
+// cache file doesn't add 2 GB to our footprint.
+//
+// A file truncated while it is mapped raises SIGBUS on the first page past
+// its new end.  The handler maps zeros over the rest and notes it, which
+// leaves things as if a file that shrank had been read: the archived copy is
+// padded out to the size in its header.
+class MappedFile
+{
+public:
+	MappedFile(int fd, size_t size);
+	~MappedFile();
+
+	// False if the file couldn't be mapped; read it another way
+	bool mapped() const { return data != nullptr; }
+
+	// Hand the file to "consume" a window at a time, in order
+	template<typename Consume>
+	void read(Consume consume);
+
+	bool truncated() const { return wasTruncated; }
+
+	static constexpr size_t window = 4 * 1024 * 1024;
+
+private:
+	static void onFault(int signal, siginfo_t *info, void *context);
+
+	unsigned char *data = nullptr;
+	size_t size;
+	volatile sig_atomic_t wasTruncated = 0;
+
+	static thread_local MappedFile *reading;	// The one this thread is inside read() for
+	static size_t pageSize;
+};
+
+thread_local MappedFile *MappedFile::reading = nullptr;
+size_t MappedFile::pageSize = 0;
+
+MappedFile::MappedFile(int fd, size_t size) : size(size)
+{
+	static bool installed = []
+	{
+		pageSize = sysconf(_SC_PAGESIZE);
+		struct sigaction action = {};
+		action.sa_sigaction = onFault;
+		action.sa_flags = SA_SIGINFO;
+		sigemptyset(&action.sa_mask);
+		return sigaction(SIGBUS, &action, nullptr) == 0;
+	}();
+	if(!installed || size == 0)
+	{
+		return;
+	}
+	void *memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(memory == MAP_FAILED)
+	{
+		return;
+	}
+	data = (unsigned char *)memory;
+	madvise(data, size, MADV_SEQUENTIAL);
+}
+
+MappedFile::~MappedFile()
+{
+	if(data)
+	{
+		munmap(data, size);
+	}
+}
+
+template<typename Consume>
+void MappedFile::read(Consume consume)
+{
+	reading = this;
+	try
+	{
+		for(size_t done = 0; done < size; done += window)
+		{
+			size_t length = std::min(window, size - done);
+			if(done + length < size)
+			{
+				madvise(data + done + length, std::min(window, size - done - length), MADV_WILLNEED);
+			}
+			consume(data + done, length);
+			madvise(data + done, length, MADV_DONTNEED);
+		}
+	}
+	catch(...)
+	{
+		reading = nullptr;
+		throw;
+	}
+	reading = nullptr;
+}
+
+void MappedFile::onFault(int signal, siginfo_t *info, void *)
+{
+	MappedFile *file = reading;
+	unsigned char *address = (unsigned char *)info->si_addr;
+	if(file && address >= file->data && address < file->data + file->size)
+	{
+		// mmap() isn't on POSIX's list of async-signal-safe functions, but
+		// on Linux it is a plain system call
+		size_t offset = (address - file->data) & ~(pageSize - 1);
+		if(mmap(file->data + offset, file->size - offset, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) != MAP_FAILED)
+		{
+			file->wasTruncated = 1;
+			return;
+		}
+	}
+	// Not a mapped read: fault again without the handler and crash as usual
+	::signal(signal, SIG_DFL);
+}
+
+// Copy up to "size" bytes from "infd" to the end of the archive through a
+// MappedFile.  Returns the number of bytes copied, which is 0 if the file
+// can't be mapped and less than "size" if it has shrunk.
+off_t copyFileMapped(int infd, OutputFile &outfile, off_t size)
+{
+	struct stat statbuf;
+	if(fstat(infd, &statbuf) != 0)
+	{
+		return 0;
+	}
+	MappedFile file(infd, std::min(size, statbuf.st_size));
+	if(!file.mapped())
+	{
+		return 0;
+	}
+	off_t copied = 0;
+	file.read([&](const unsigned char *data, size_t length)
+	{
+		outfile.write(data, length);
+		copied += length;
+		Stats::add(Stats::BytesRead, length);
+	});
+	return copied;
+}
+
+// A file being read ahead of the archive writer by a ReadAhead engine
+struct PrefetchedFile
+{
+	~PrefetchedFile()
+	{
+		if(fd != -1)
+		{
+			close(fd);
+		}
+	}
+
+	int fd = -1;
+	struct stat statbuf;
+	int openErrno = 0;	// Set if open() failed
+	int readErrno = 0;	// Set if a read failed
+	std::unique_ptr<unsigned char[]> data;
+	unsigned char *buffer = nullptr;	// Where it is read to: data, or the caller's buffer
+	size_t wanted = 0;
+	size_t length = 0;	// Bytes read so far
+	bool done = false;
+	bool synchronous = false;	// The engine couldn't read this one; do it at wait() time
+};
+
+// Reads files ahead of the archive writer, keeping many reads in flight at
+// once so that spinning disks and USB images see more than one request at a
+// time.  Files are handed to the writer strictly in the order they were
+// started.  The io_uring engine is used where the kernel allows it, with a
+// pool of threads doing ordinary reads as the fallback.
+class ReadAhead
+{
+public:
+	static std::unique_ptr<ReadAhead> create(unsigned depth);
+
+	virtual ~ReadAhead() {}
+
+	// Start reading a file, into "into" if given, which must have room for
+	// st_size bytes.  Returns nullptr for files too big to be worth holding
+	// in memory, which should be archived the normal way.
+	std::shared_ptr<PrefetchedFile> start(const std::filesystem::path &source, const struct stat &statbuf, unsigned char *into = nullptr);
+
+	// Hand every read start()ed since the last push() to the kernel in one
+	// go.  Until then, they may not have begun.
+	virtual void push() {}
+
+	// Wait until a file started earlier has been read
+	void wait(PrefetchedFile &file);
+
+	static const off_t maxFileSize = 4 * 1024 * 1024;
+
+protected:
+	virtual void submit(PrefetchedFile &file) = 0;
+	virtual void waitFor(PrefetchedFile &file) = 0;
+
+	static void readRemainder(PrefetchedFile &file);
+};
+
+std::shared_ptr<PrefetchedFile> ReadAhead::start(const std::filesystem::path &source, const struct stat &statbuf, unsigned char *into)
+{
+	if(statbuf.st_size > maxFileSize)
+	{
+		return nullptr;
+	}
+	auto file = std::make_shared<PrefetchedFile>();
+	file->statbuf = statbuf;
+	file->fd = open(source.c_str(), O_RDONLY);
+	if(file->fd == -1)
+	{
+		file->openErrno = errno;
+		file->done = true;
+		return file;
+	}
+	file->wanted = file->statbuf.st_size;
+	if(file->wanted == 0)
+	{
+		file->done = true;
+		return file;
+	}
+	if(into)
+	{
+		file->buffer = into;
+	}
+	else
+	{
+		file->data.reset(new unsigned char[file->wanted]);
+		file->buffer = file->data.get();
+	}
+	submit(*file);
+	return file;
+}
+
+void ReadAhead::wait(PrefetchedFile &file)
+{
+	if(!file.done)
+	{
+		waitFor(file);
+	}
+	if(file.synchronous)
+	{
+		readRemainder(file);
+	}
+}
+
+// Read whatever is left of a file with ordinary blocking reads
+void ReadAhead::readRemainder(PrefetchedFile &file)
+{
+	while(file.length < file.wanted && file.readErrno == 0)
+	{
+		ssize_t result = pread(file.fd, file.buffer + file.length, file.wanted - file.length, file.length);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result < 0)
+		{
+			file.readErrno = errno;
+		}
+		else if(result == 0)
+		{
+			break;
+		}
+		else
+		{
+			file.length += result;
+		}
+	}
+	file.synchronous = false;
+	file.done = true;
+}
+
+// An io_uring, driven directly through the system calls so that we don't need
+// liburing to build
+class Uring
+{
+public:
+	// Returns nullptr if the kernel doesn't have io_uring or won't let us
+	// use it
+	static std::unique_ptr<Uring> create(unsigned depth);
+	~Uring();
+
+	// A cleared submission queue entry to fill in, queued to go with the
+	// next enter().  No more than capacity() may be in flight at once.
+	struct io_uring_sqe *prepare();
+
+	// Submit everything prepared and wait for at least "wait" completions
+	void enter(unsigned wait);
+
+	// Call "complete" with the user_data and result of each completion
+	// that has arrived
+	template<typename Complete>
+	void reap(Complete complete);
+
+	unsigned capacity() const { return entries; }
+
+private:
+	Uring() = default;
+
+	int ring = -1;
+	unsigned entries = 0;
+	unsigned unsubmitted = 0;
+
+	void *sqRing = MAP_FAILED;
+	size_t sqRingSize = 0;
+	void *cqRing = MAP_FAILED;
+	size_t cqRingSize = 0;
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+	size_t sqesSize = 0;
+
+	unsigned *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+};
+
+std::unique_ptr<Uring> Uring::create(unsigned depth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring = syscall(__NR_io_uring_setup, depth, &params);
+	if(ring < 0)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<Uring> uring(new Uring);
+	uring->ring = ring;
+	uring->entries = params.sq_entries;
+	uring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	uring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		uring->sqRingSize = uring->cqRingSize = std::max(uring->sqRingSize, uring->cqRingSize);
+	}
+	uring->sqRing = mmap(nullptr, uring->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	if(uring->sqRing == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		uring->cqRing = uring->sqRing;
+	}
+	else
+	{
+		uring->cqRing = mmap(nullptr, uring->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+		if(uring->cqRing == MAP_FAILED)
+		{
+			return nullptr;
+		}
+	}
+	uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = (struct io_uring_sqe *)mmap(nullptr, uring->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+	if(uring->sqes == MAP_FAILED)
+	{
+		return nullptr;
+	}
+
+	char *sq = (char *)uring->sqRing;
+	uring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	uring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	uring->sqArray = (unsigned *)(sq + params.sq_off.array);
+	char *cq = (char *)uring->cqRing;
+	uring->cqHead = (unsigned *)(cq + params.cq_off.head);
+	uring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	uring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return uring;
+}
+
+Uring::~Uring()
+{
+	if(sqes != MAP_FAILED)
+	{
+		munmap(sqes, sqesSize);
+	}
+	if(cqRing != MAP_FAILED && cqRing != sqRing)
+	{
+		munmap(cqRing, cqRingSize);
+	}
+	if(sqRing != MAP_FAILED)
+	{
+		munmap(sqRing, sqRingSize);
+	}
+	if(ring != -1)
+	{
+		close(ring);
+	}
+}
+
+struct io_uring_sqe *Uring::prepare()
+{
+	unsigned tail = *sqTail;
+	unsigned index = tail & *sqMask;
+	struct io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray[index] = index;
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	unsubmitted++;
+	return sqe;
+}
+
+void Uring::enter(unsigned wait)
+{
+	if(unsubmitted == 0 && wait == 0)
+	{
+		return;
+	}
+	while(true)
+	{
+		int result = syscall(__NR_io_uring_enter, ring, unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if(result >= 0)
+		{
+			unsubmitted -= result;
+			if(unsubmitted == 0 || wait)
+			{
+				return;
+			}
+		}
+		else if(errno == EINTR || (!wait && (errno == EAGAIN || errno == EBUSY)))
+		{
+			continue;
+		}
+		else
+		{
+			fprintf(stderr, "Error %s %s io_uring\n", strerror(errno), wait ? "waiting on" : "submitting to");
+			throw std::runtime_error("Error reading input file");
+		}
+	}
+}
+
+template<typename Complete>
+void Uring::reap(Complete complete)
+{
+	unsigned head = *cqHead;
+	unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+	for(; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+		complete(cqe->user_data, cqe->res);
+	}
+	__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+// Read-ahead through io_uring
+class UringReadAhead : public ReadAhead
+{
+public:
+	static std::unique_ptr<ReadAhead> create(unsigned depth);
+	~UringReadAhead();
+
+	void push() override;
+
+protected:
+	void submit(PrefetchedFile &file) override;
+	void waitFor(PrefetchedFile &file) override;
+
+private:
+	UringReadAhead() = default;
+	void reap(bool block);
+
+	std::unique_ptr<Uring> uring;
+	unsigned inFlight = 0;	// Including those not pushed yet
+};
+
+std::unique_ptr<ReadAhead> UringReadAhead::create(unsigned depth)
+{
+	std::unique_ptr<Uring> uring = Uring::create(depth);
+	if(!uring)
+	{
+		return nullptr;
+	}
+	std::unique_ptr<UringReadAhead> engine(new UringReadAhead);
+	engine->uring = std::move(uring);
+	return engine;
+}
+
+UringReadAhead::~UringReadAhead()
+{
+	// The kernel may still be writing into buffers we are about to free
+	try
+	{
+		while(inFlight > 0)
+		{
+			reap(true);
+		}
+	}
+	catch(std::exception &e)
+	{
+	}
+}
+
+void UringReadAhead::submit(PrefetchedFile &file)
+{
+	while(inFlight >= uring->capacity())
+	{
+		reap(true);
+	}
+
+	struct io_uring_sqe *sqe = uring->prepare();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = file.fd;
+	sqe->addr = (uintptr_t)(file.buffer + file.length);
+	sqe->len = file.wanted - file.length;
+	sqe->off = file.length;
+	sqe->user_data = (uintptr_t)&file;
+	inFlight++;
+}
+
+void UringReadAhead::push()
+{
+	uring->enter(0);
+}
+
+void UringReadAhead::waitFor(PrefetchedFile &file)
+{
+	while(!file.done)
+	{
+		reap(true);
+	}
+}
+
+// Process completed reads, optionally waiting for at least one
+void UringReadAhead::reap(bool block)
+{
+	if(block)
+	{
+		uring->enter(1);
+	}
+
+	std::vector<PrefetchedFile *> resubmit;
+	uring->reap([&](uint64_t data, int result)
+	{
+		PrefetchedFile *file = (PrefetchedFile *)(uintptr_t)data;
+		inFlight--;
+
+		if(result == -EINTR || result == -EAGAIN)
+		{
+			resubmit.push_back(file);
+		}
+		else if(result == -EINVAL || result == -EOPNOTSUPP)
+		{
+			// A kernel too old for IORING_OP_READ, or a file that
+			// can't be read this way
+			file->synchronous = true;
+			file->done = true;
+		}
+		else if(result < 0)
+		{
+			file->readErrno = -result;
+			file->done = true;
+		}
+		else if(result == 0)
+		{
+			file->done = true;
+		}
+		else
+		{
+			file->length += result;
+			if(file->length < file->wanted)
+			{
+				resubmit.push_back(file);
+			}
+			else
+			{
+				file->done = true;
+			}
+		}
+	});
+
+	for(PrefetchedFile *file : resubmit)
+	{
+		submit(*file);
+	}
+}
+
+// The fallback: a pool of threads doing blocking reads
+class ThreadPoolReadAhead : public ReadAhead
+{
+public:
+	ThreadPoolReadAhead(unsigned threads);
+	~ThreadPoolReadAhead();
+
+protected:
+	void submit(PrefetchedFile &file) override;
+	void waitFor(PrefetchedFile &file) override;
+
+private:
+	void run();
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable finished;
+	std::deque<PrefetchedFile *> queue;
+	bool stopping = false;
+	std::vector<std::thread> workers;
+};
+
+ThreadPoolReadAhead::ThreadPoolReadAhead(unsigned threads)
+{
+	for(unsigned i = 0; i < threads; i++)
+	{
+		workers.emplace_back(&ThreadPoolReadAhead::run, this);
+	}
+}
+
+ThreadPoolReadAhead::~ThreadPoolReadAhead()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+		queue.clear();
+	}
+	wake.notify_all();
+	for(auto &worker : workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPoolReadAhead::submit(PrefetchedFile &file)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_back(&file);
+	}
+	wake.notify_one();
+}
+
+void ThreadPoolReadAhead::waitFor(PrefetchedFile &file)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	finished.wait(guard, [&]{ return file.done; });
+}
+
+void ThreadPoolReadAhead::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		wake.wait(guard, [this]{ return !queue.empty() || stopping; });
+		if(stopping)
+		{
+			break;
+		}
+		PrefetchedFile *file = queue.front();
+		queue.pop_front();
+		guard.unlock();
+
+		readRemainder(*file);
+
+		guard.lock();
+		file->done = true;
+		finished.notify_all();
+	}
+}
+
+// Reads each file when it is waited for, for small-file batches where there
+// is no io_uring.  A thread per read would cost more than it saves.
+class DeferredReadAhead : public ReadAhead
+{
+protected:
+	void submit(PrefetchedFile &file) override
+	{
+		file.synchronous = true;
+		file.done = true;
+	}
+
+	void waitFor(PrefetchedFile &) override {}
+};
+
+std::unique_ptr<ReadAhead> ReadAhead::create(unsigned depth)
+{
+	std::unique_ptr<ReadAhead> engine = UringReadAhead::create(depth);
+	if(!engine)
+	{
+		engine = std::make_unique<ThreadPoolReadAhead>(std::min(depth, 16u));
+	}
+	return engine;
+}
+
+// Fill in the tar header block for a file, or for a hard link to the file
+// called "linkTarget" in the archive if one is given
+void makeTarHeader(unsigned char *buffer, const std::string &tarFilename, const struct stat &statbuf, const std::string &linkTarget = std::string())
+{
+	memset(buffer, 0, 512);
+	memcpy(buffer, tarFilename.data(), std::min<size_t>(tarFilename.length(), 100));
+	memcpy(buffer+100, "0000644", 8);
+	memcpy(buffer+108, "0001750", 8);
+	memcpy(buffer+116, "0001750", 8);
+	sprintf((char *)(buffer+124), "%011lo", linkTarget.empty() ? statbuf.st_size : 0);
+	sprintf((char *)(buffer+136), "%011lo", statbuf.st_mtime);
+	memset(buffer+148, ' ', 8);
+	if(!linkTarget.empty())
+	{
+		// A hard link: typeflag '1', no data, and the name of the file in
+		// the archive it is a link to
+		buffer[156] = '1';
+		memcpy(buffer+157, linkTarget.data(), std::min<size_t>(linkTarget.length(), 100));
+	}
+	memcpy(buffer+257, "ustar", 6);
+	memcpy(buffer+263, "00", 2);	// The "2" is correct: this field is not null-terminated
+	memcpy(buffer+265, "user", 5);
+	memcpy(buffer+297, "user", 5);
+	
+	int checksum = 0;
+	for(int i = 0; i < 512; i++)
+	{
+		checksum += buffer[i];
+	}
+	sprintf((char *)(buffer+148), "%07o", checksum);
+}
+
+// Add a file to the tarball
+//
+// "statbuf" is the file's metadata, as found while scanning.
+// "tarName" is the file's name in the tarball
+bool addFileToTar(const std::filesystem::path &source, const struct stat &statbuf, const std::string &tarName, OutputFile &outfile, [[maybe_unused]]int verbose)
+{
+	Profile::ItemTimer itemTimer(Profile::File, source);
+	unsigned char buffer[512];
+	
+	makeTarHeader(buffer, tarName, statbuf);
+	
+	int infile;
+	{
+		Profile::Timer timer(Profile::ReadFile);
+		infile = open(source.c_str(), O_RDONLY);
+	}
+	if(infile != -1)
+	{
+		outfile.write(buffer, 512);
+		
+		off_t copied = 0;
+		if(statbuf.st_size >= kernelCopyThreshold)
+		{
+			copied = copyFileKernel(infile, outfile, statbuf.st_size, source);
+		}
+		if(copied == 0 && statbuf.st_size >= mappedReadThreshold)
+		{
+			copied = copyFileMapped(infile, outfile, statbuf.st_size);
+		}
+		
+		// Anything the kernel couldn't copy for us is read straight into
+		// the output buffer.  Never copy more than the header promised,
+		// even if the file grew after we stat()ed it.
+		while(copied < statbuf.st_size)
+		{
+			size_t wanted = statbuf.st_size - copied;
+			unsigned char *dest = outfile.reserve(wanted);
+			ssize_t bytesRead;
+			{
+				Profile::Timer timer(Profile::ReadFile);
+				bytesRead = read(infile, dest, wanted);
+			}
+			if(bytesRead < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if(bytesRead < 0)
+			{
+				fprintf(stderr, "Read error %s for file %s when adding to archive\n", strerror(errno), source.c_str());
+				throw std::runtime_error("Error reading input file");
+			}
+			if(bytesRead == 0)
+			{
+				break;
+			}
+			outfile.commit(bytesRead);
+			copied += bytesRead;
+			Stats::add(Stats::BytesRead, bytesRead);
+		}
+		close(infile);
+		
+		// The Tar file format consists of null-padded 512-byte blocks.
+		// If the file shrank, pad it out to the size in the header so
+		// the rest of the archive stays readable.
+		outfile.writeZeros(statbuf.st_size - copied + (512 - statbuf.st_size % 512) % 512);
+		outfile.fileDone();
+		return true;
+	}
+	fprintf(stderr, "Open error %s for file %s when adding to archive\n", strerror(errno), source.c_str());
+	Stats::add(Stats::Errors);
+	return false;
+}
+
+// Add a file that a ReadAhead engine has already read to the tarball
+bool addFileToTar(const std::filesystem::path &source, const std::string &tarName, OutputFile &outfile, [[maybe_unused]]int verbose, const PrefetchedFile &file)
+{
+	if(file.openErrno)
+	{
+		fprintf(stderr, "Open error %s for file %s when adding to archive\n", strerror(file.openErrno), source.c_str());
+		Stats::add(Stats::Errors);
+		return false;
+	}
+	if(file.readErrno)
+	{
+		fprintf(stderr, "Read error %s for file %s when adding to archive\n", strerror(file.readErrno), source.c_str());
+		throw std::runtime_error("Error reading input file");
+	}
+	
+	unsigned char header[512];
+	makeTarHeader(header, tarName, file.statbuf);
+	outfile.write(header, 512);
+	outfile.write(file.buffer, file.length);
+	Stats::add(Stats::BytesRead, file.length);
+	outfile.writeZeros(file.wanted - file.length + (512 - file.wanted % 512) % 512);
+	outfile.fileDone();
+	return true;
+}
+
+// Add a hard link to a file already in the tarball, for --dedup.  "target"
+// is the earlier file's name in the tarball.
+void addLinkToTar(const std::string &tarName, const std::string &target, const struct stat &statbuf, OutputFile &outfile)
+{
+	unsigned char header[512];
+	makeTarHeader(header, tarName, statbuf, target);
+	outfile.write(header, 512);
+	outfile.fileDone();
+}
+
+// Streaming XXH64, used to tell apart files of the same size
+class Hash64
+{
+public:
+	Hash64()
+	{
+		state[0] = prime1 + prime2;
+		state[1] = prime2;
+		state[2] = 0;
+		state[3] = -prime1;
+	}
+
+	void update(const unsigned char *data, size_t length)
+	{
+		total += length;
+		if(buffered)
+		{
+			size_t taken = std::min(length, sizeof(buffer) - buffered);
+			memcpy(buffer + buffered, data, taken);
+			buffered += taken;
+			data += taken;
+			length -= taken;
+			if(buffered < sizeof(buffer))
+			{
+				return;
+			}
+			stripe(buffer);
+			buffered = 0;
+		}
+		for(; length >= sizeof(buffer); data += sizeof(buffer), length -= sizeof(buffer))
+		{
+			stripe(data);
+		}
+		memcpy(buffer, data, length);
+		buffered = length;
+	}
+
+	uint64_t digest() const
+	{
+		uint64_t hash = prime5;
+		if(total >= sizeof(buffer))
+		{
+			hash = rotate(state[0], 1) + rotate(state[1], 7) + rotate(state[2], 12) + rotate(state[3], 18);
+			for(uint64_t lane : state)
+			{
+				hash = (hash ^ round(0, lane)) * prime1 + prime4;
+			}
+		}
+		hash += total;
+
+		const unsigned char *tail = buffer;
+		size_t left = buffered;
+		for(; left >= 8; tail += 8, left -= 8)
+		{
+			hash = rotate(hash ^ round(0, read64(tail)), 27) * prime1 + prime4;
+		}
+		if(left >= 4)
+		{
+			uint32_t word;
+			memcpy(&word, tail, 4);
+			hash = rotate(hash ^ (word * prime1), 23) * prime2 + prime3;
+			tail += 4;
+			left -= 4;
+		}
+		for(; left > 0; tail++, left--)
+		{
+			hash = rotate(hash ^ (*tail * prime5), 11) * prime1;
+		}
+
+		hash ^= hash >> 33;
+		hash *= prime2;
+		hash ^= hash >> 29;
+		hash *= prime3;
+		hash ^= hash >> 32;
+		return hash;
+	}
+
+private:
+	static constexpr uint64_t prime1 = 11400714785074694791ULL;
+	static constexpr uint64_t prime2 = 14029467366897019727ULL;
+	static constexpr uint64_t prime3 = 1609587929392839161ULL;
+	static constexpr uint64_t prime4 = 9650029242287828579ULL;
+	static constexpr uint64_t prime5 = 2870177450012600261ULL;
+
+	static uint64_t rotate(uint64_t value, int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	static uint64_t read64(const unsigned char *data)
+	{
+		uint64_t value;
+		memcpy(&value, data, 8);
+		return value;
+	}
+
+	static uint64_t round(uint64_t lane, uint64_t input)
+	{
+		return rotate(lane + input * prime2, 31) * prime1;
+	}
+
+	void stripe(const unsigned char *data)
+	{
+		for(int i = 0; i < 4; i++)
+		{
+			state[i] = round(state[i], read64(data + i * 8));
+		}
+	}
+
+	uint64_t state[4];
+	unsigned char buffer[32];
+	size_t buffered = 0;
+	uint64_t total = 0;
+};
+
+// Spots files that are already in the tarball, for --dedup.  Hard links to
+// an archived inode are recognised by st_dev/st_ino alone.  Otherwise a file
+// is only hashed if an archived file has the same size, and the archived
+// file is only hashed the first time that happens, so unique files, which
+// are nearly all of them, are never read twice.
+class DuplicateFinder
+{
+public:
+	// The name in the tarball of an earlier copy of "source", or an empty
+	// string if there isn't one.  Files of the same size and hash are
+	// compared byte for byte before one counts as a copy of the other.
+	std::string findOriginal(const std::filesystem::path &source, const struct stat &statbuf);
+
+	// Remember "tarName" as the name of this content from now on, once
+	// "source" is in the tarball under it, so that nothing ever links to
+	// a file that couldn't be archived
+	void archived(const std::filesystem::path &source, const struct stat &statbuf, const std::string &tarName);
+
+private:
+	struct Original
+	{
+		std::filesystem::path source;
+		std::string tarName;
+		uint64_t hash;
+		bool hashed;	// Whether hashing has been tried
+		bool readable;	// Whether it worked
+	};
+
+	static bool hashFile(const std::filesystem::path &source, off_t size, uint64_t &hash);
+	static bool sameContents(const std::filesystem::path &first, const std::filesystem::path &second, off_t size);
+
+	std::map<std::pair<dev_t, ino_t>, std::string> inodes;
+	std::unordered_map<off_t, std::vector<Original>> sizes;
+
+	// The last file findOriginal() hashed, so that archived() usually
+	// doesn't have to hash it again
+	std::filesystem::path lastSource;
+	uint64_t lastHash = 0;
+};
+
+std::string DuplicateFinder::findOriginal(const std::filesystem::path &source, const struct stat &statbuf)
+{
+	// An empty file's header is all there is to it, so a link saves nothing
+	if(statbuf.st_size == 0)
+	{
+		return std::string();
+	}
+	auto inode = inodes.find({statbuf.st_dev, statbuf.st_ino});
+	if(inode != inodes.end())
+	{
+		return inode->second;
+	}
+
+	auto sameSize = sizes.find(statbuf.st_size);
+	uint64_t hash;
+	if(sameSize == sizes.end() || !hashFile(source, statbuf.st_size, hash))
+	{
+		return std::string();
+	}
+	lastSource = source;
+	lastHash = hash;
+	for(auto &original : sameSize->second)
+	{
+		if(!original.hashed)
+		{
+			original.hashed = true;
+			original.readable = hashFile(original.source, statbuf.st_size, original.hash);
+		}
+		// A 64-bit hash can collide, and a link would silently swap one
+		// file's contents for the other's
+		if(original.readable && original.hash == hash && sameContents(original.source, source, statbuf.st_size))
+		{
+			inodes.emplace(std::make_pair(statbuf.st_dev, statbuf.st_ino), original.tarName);
+			return original.tarName;
+		}
+	}
+	return std::string();
+}
+
+void DuplicateFinder::archived(const std::filesystem::path &source, const struct stat &statbuf, const std::string &tarName)
+{
+	if(statbuf.st_size == 0)
+	{
+		return;
+	}
+	bool hashed = source == lastSource;
+	sizes[statbuf.st_size].push_back({source, tarName, hashed ? lastHash : 0, hashed, hashed});
+	inodes.emplace(std::make_pair(statbuf.st_dev, statbuf.st_ino), tarName);
+}
+
+// Compare the first "size" bytes of two files.  Either one being unreadable
+// or shorter than "size" counts as a difference.
+bool DuplicateFinder::sameContents(const std::filesystem::path &first, const std::filesystem::path &second, off_t size)
+{
+	Profile::Timer timer(Profile::ReadFile);
+	int fds[2] = {open(first.c_str(), O_RDONLY|O_CLOEXEC), open(second.c_str(), O_RDONLY|O_CLOEXEC)};
+	static thread_local std::vector<unsigned char> buffers[2] = {std::vector<unsigned char>(256 * 1024), std::vector<unsigned char>(256 * 1024)};
+	bool same = fds[0] != -1 && fds[1] != -1;
+	for(off_t done = 0; same && done < size; )
+	{
+		size_t wanted = std::min<off_t>(buffers[0].size(), size - done);
+		for(int i = 0; same && i < 2; i++)
+		{
+			for(size_t got = 0; same && got < wanted; )
+			{
+				ssize_t length = pread(fds[i], buffers[i].data() + got, wanted - got, done + got);
+				if(length < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				same = length > 0;
+				got += std::max<ssize_t>(length, 0);
+				Stats::add(Stats::BytesRead, std::max<ssize_t>(length, 0));
+			}
+		}
+		same = same && 0 == memcmp(buffers[0].data(), buffers[1].data(), wanted);
+		done += wanted;
+	}
+	for(int fd : fds)
+	{
+		if(fd != -1)
+		{
+			close(fd);
+		}
+	}
+	return same;
+}
+
+// Hash the first "size" bytes of a file, which is all that would be archived
+bool DuplicateFinder::hashFile(const std::filesystem::path &source, off_t size, uint64_t &hash)
+{
+	Profile::Timer timer(Profile::ReadFile);
+	int fd = open(source.c_str(), O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+	{
+		return false;
+	}
+	Hash64 hasher;
+	if(size >= mappedReadThreshold)
+	{
+		MappedFile file(fd, size);
+		if(file.mapped())
+		{
+			file.read([&](const unsigned char *data, size_t length)
+			{
+				hasher.update(data, length);
+				Stats::add(Stats::BytesRead, length);
+			});
+			close(fd);
+			hash = hasher.digest();
+			// A file that shrank is unreadable here, as it is below
+			return !file.truncated();
+		}
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	static thread_local std::vector<unsigned char> buffer(1024 * 1024);
+	off_t done = 0;
+	while(done < size)
+	{
+		ssize_t length = read(fd, buffer.data(), std::min<off_t>(buffer.size(), size - done));
+		if(length < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(length <= 0)
+		{
+			close(fd);
+			return false;
+		}
+		hasher.update(buffer.data(), length);
+		done += length;
+		Stats::add(Stats::BytesRead, length);
+	}
+	close(fd);
+	hash = hasher.digest();
+	return true;
+}
+
+// Append "value" to "out" as a JSON string.  Names are bytes, not
+// necessarily UTF-8; anything that isn't a control character is copied as
+// it is.
+void appendJsonString(std::string &out, const std::string &value)
+{
+	out += '"';
+	for(unsigned char c : value)
+	{
+		if(c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if(c < 0x20)
+		{
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", c);
+			out += escape;
+		}
+		else
+		{
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+// The --manifest: a JSON object per line for every file chosen for the
+// archive, giving its name in the archive, where it was found, its size and
+// mtime, and the rule that chose it
+class Manifest
+{
+public:
+	// A new manifest, or for --resume the one there is, cut back to
+	// "resumeLength"
+	explicit Manifest(const std::string &filename, off_t resumeLength = -1);
+	~Manifest();
+
+	// Safe to call from any thread, as split volumes are written at once
+	void add(const std::filesystem::path &source, const std::string &tarName, const struct stat &statbuf);
+
+	// Push what has been written to disk and return its length, for a
+	// checkpoint
+	off_t checkpoint();
+
+	// Flush the manifest to disk.  Throws if anything couldn't be written.
+	void close();
+
+private:
+	std::string filename;
+	FILE *file;
+	std::mutex lock;
+	std::string line;
+};
+
+Manifest::Manifest(const std::string &filename, off_t resumeLength) : filename(filename)
+{
+	file = fopen(filename.c_str(), (resumeLength < 0) ? "wx" : "r+");
+	if(file && resumeLength >= 0 && (0 != ftruncate(fileno(file), resumeLength) || 0 != fseeko(file, resumeLength, SEEK_SET)))
+	{
+		fclose(file);
+		file = nullptr;
+	}
+	if(!file)
+	{
+		fprintf(stderr, "Error %s opening manifest %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to open manifest");
+	}
+}
+
+Manifest::~Manifest()
+{
+	if(file)
+	{
+		fclose(file);
+	}
+}
+
+void Manifest::add(const std::filesystem::path &source, const std::string &tarName, const struct stat &statbuf)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	line = "{\"name\":";
+	appendJsonString(line, tarName);
+	line += ",\"source\":";
+	appendJsonString(line, source.native());
+	line += ",\"size\":" + std::to_string(statbuf.st_size);
+	line += ",\"mtime\":" + std::to_string(statbuf.st_mtime);
+	line += ",\"rule\":";
+	appendJsonString(line, describeRule(source));
+	line += "}\n";
+	if(line.size() != fwrite(line.data(), 1, line.size(), file))
+	{
+		fprintf(stderr, "Error %s writing manifest %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to write manifest");
+	}
+}
+
+off_t Manifest::checkpoint()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	off_t length = ftello(file);
+	if(0 != fflush(file) || 0 != fdatasync(fileno(file)) || length < 0)
+	{
+		fprintf(stderr, "Error %s writing manifest %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to write manifest");
+	}
+	return length;
+}
+
+void Manifest::close()
+{
+	bool failed = (0 != fflush(file)) || (0 != fsync(fileno(file)));
+	failed = (0 != fclose(file)) || failed;
+	file = nullptr;
+	if(failed)
+	{
+		fprintf(stderr, "Error %s writing manifest %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to write manifest");
+	}
+}
+
+// What a directory is, which decides what happens to the files in it.  This
+// is known before the directory is read, from its name and its parent's.
+enum DirKind
+{
+	RootDir,	// The search path itself, whose files aren't archived
+	PlainDir,	// Only cache-named files are archived
+	CacheDir,	// Every file is archived
+};
+
+// A file picked out of a directory's listing to be archived
+struct FoundFile
+{
+	std::string name;
+	struct stat statbuf;
+};
+
+struct DirEntry;
+
+// The journal for --checkpoint and --resume, kept beside the archive with
+// ".checkpoint" on the end of its name.  Records are appended as the scan
+// goes: the number each directory is archived under, every file as it goes
+// into the archive, and every directory once it is finished with, along with
+// what a resumed run needs to descend through it again without reading it.
+// Every so often the writer makes the archive durable and appends a commit
+// with its length, the manifest's, and gDirCounter, then syncs the journal.
+//
+// A resumed run reads the journal up to its last commit, cuts the archive
+// and manifest back to the lengths it gives, and carries on from there.
+// Finished directories are only descended through; directories that were
+// part way through are read again and archived under the number they had,
+// leaving out the files already in the archive.  The journal is deleted once
+// the archive is complete.  Like the state file, it is in native byte order.
+class Checkpoint
+{
+public:
+	struct Subdir
+	{
+		std::string name;
+		unsigned char type;
+	};
+
+	// What a finished directory left for a resumed run
+	struct Dir
+	{
+		struct stat statbuf;
+		DirKind kind;
+		std::vector<Subdir> subdirs;
+		std::vector<FoundFile> files;	// Only kept for --state-file
+	};
+
+	// Start a new journal for "output", or with "resume" read the one there
+	// is and carry on appending to it.  A commit is due every "interval"
+	// seconds.
+	Checkpoint(const std::string &output, int interval, bool resume, Compressor::Format compression, bool manifest);
+	~Checkpoint();
+
+	// Where the last commit of a resumed journal left the archive and
+	// manifest
+	off_t archiveLength() const { return lastArchiveLength; }
+	off_t manifestLength() const { return lastManifestLength; }
+
+	// A directory finished with before the resumed checkpoint, or nullptr
+	const Dir *finished(const std::string &path) const;
+
+	// The number a directory was being archived under when the resumed
+	// journal was last committed, or 0
+	int number(const std::string &path) const;
+
+	// Whether a file was already in the archive at the resumed checkpoint
+	bool archived(const std::string &path) const;
+
+	// Journal a directory's number, or a file as it goes into the
+	// archive.  Safe to call from any thread.
+	void started(const std::string &path, int number);
+	void fileAdded(const std::string &path);
+
+	// The record journaled for a directory once everything it added is in
+	// the archive, which may be some time after it was read
+	static std::string describe(const std::string &path, const struct stat &statbuf, DirKind kind, const std::vector<DirEntry> &subdirs, const std::vector<FoundFile> &files);
+	void append(const std::string &record);
+
+	// Whether it's time for the archive's writer to commit
+	bool due() const { return std::chrono::steady_clock::now() >= nextCommit; }
+
+	// Append a commit, once the archive is durable up to "archiveLength"
+	// and the manifest, if there is one, up to "manifestLength"
+	void commit(off_t archiveLength, off_t manifestLength);
+
+	// Delete the journal, once the archive is complete
+	void remove();
+
+private:
+	enum RecordType : uint32_t
+	{
+		Begin,		// The first record: magic, compression and manifest
+		Started,	// A directory's number
+		Added,		// A file in the archive
+		Finished,	// A directory finished with
+		Commit,		// The archive and manifest lengths, and gDirCounter
+	};
+
+	static void put(std::string &out, const void *data, size_t length);
+	static void putString(std::string &out, std::string_view value);
+	static std::string record(RecordType type, const std::string &payload);
+	void load(Compressor::Format compression, bool manifest);
+
+	std::string filename;
+	int fd = -1;
+	std::chrono::seconds interval;
+	std::chrono::steady_clock::time_point nextCommit;
+
+	std::mutex lock;
+	std::string pending;	// Records not yet written to the journal
+
+	// From the resumed journal
+	off_t lastArchiveLength = 0;
+	off_t lastManifestLength = -1;
+	std::unordered_map<std::string, Dir> finishedDirs;
+	std::unordered_map<std::string, int> numbers;
+	std::unordered_set<std::string> archivedFiles;
+
+	static constexpr char magic[8] = {'R', 'S', 'C', 'F', 'C', 'P', '0', '1'};
+};
+
+// The journal for --checkpoint, if there is one
+Checkpoint *gCheckpoint = nullptr;
+
+// The profile file is created up front, so that a run isn't wasted finding
+// out at the end that it can't be written
+void Profile::open(const std::string &name)
+{
+	filename = name;
+	file = fopen(filename.c_str(), "wx");
+	if(!file)
+	{
+		fprintf(stderr, "Error %s opening profile %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to open profile");
+	}
+	startTime = nanoseconds();
+	enabled = true;
+}
+
+// Phase times are summed over every thread, so with --jobs or --read-ahead
+// they can add up to more than the wall time
+void Profile::write()
+{
+	static const char *phaseNames[PhaseCount] = {"enumerate", "classify", "stat", "read", "write", "flush", "prefetch"};
+	static const char *itemNames[ItemCount] = {"directories", "files"};
+	uint64_t wallTime = nanoseconds() - startTime;
+	enabled = false;
+
+	uint64_t phaseTime[PhaseCount] = {};
+	uint64_t phaseCount[PhaseCount] = {};
+	uint64_t histogram[ItemCount][buckets] = {};
+	std::vector<Slow> slowest[ItemCount];
+	for(auto &block : blocks)
+	{
+		for(int phase = 0; phase < PhaseCount; phase++)
+		{
+			phaseTime[phase] += block->phaseTime[phase];
+			phaseCount[phase] += block->phaseCount[phase];
+		}
+		for(int item = 0; item < ItemCount; item++)
+		{
+			for(int bucket = 0; bucket < buckets; bucket++)
+			{
+				histogram[item][bucket] += block->histogram[item][bucket];
+			}
+			slowest[item].insert(slowest[item].end(), block->slowest[item].begin(), block->slowest[item].end());
+		}
+	}
+
+	char number[64];
+	std::string out = "{\n";
+	snprintf(number, sizeof(number), "%.6f", wallTime / 1e9);
+	out += "\t\"wall_seconds\": " + std::string(number) + ",\n";
+	out += "\t\"phases\": {\n";
+	for(int phase = 0; phase < PhaseCount; phase++)
+	{
+		snprintf(number, sizeof(number), "%.6f", phaseTime[phase] / 1e9);
+		out += "\t\t\"" + std::string(phaseNames[phase]) + "\": {\"seconds\": " + number + ", \"calls\": " + std::to_string(phaseCount[phase]) + "}";
+		out += (phase + 1 < PhaseCount) ? ",\n" : "\n";
+	}
+	out += "\t},\n";
+	for(int item = 0; item < ItemCount; item++)
+	{
+		uint64_t count = 0;
+		for(int bucket = 0; bucket < buckets; bucket++)
+		{
+			count += histogram[item][bucket];
+		}
+		out += "\t\"" + std::string(itemNames[item]) + "\": {\n";
+		out += "\t\t\"count\": " + std::to_string(count) + ",\n";
+		// Bucket "under_us": N holds everything from N/2 up to N microseconds
+		out += "\t\t\"histogram\": [";
+		bool first = true;
+		for(int bucket = 0; bucket < buckets; bucket++)
+		{
+			if(histogram[item][bucket])
+			{
+				out += first ? "\n" : ",\n";
+				out += "\t\t\t{\"under_us\": " + std::to_string(1ull << bucket) + ", \"count\": " + std::to_string(histogram[item][bucket]) + "}";
+				first = false;
+			}
+		}
+		out += first ? "],\n" : "\n\t\t],\n";
+		std::sort(slowest[item].begin(), slowest[item].end());
+		if(slowest[item].size() > slowestKept)
+		{
+			slowest[item].resize(slowestKept);
+		}
+		out += "\t\t\"slowest\": [";
+		for(size_t i = 0; i < slowest[item].size(); i++)
+		{
+			snprintf(number, sizeof(number), "%.6f", slowest[item][i].time / 1e9);
+			out += i ? ",\n" : "\n";
+			out += "\t\t\t{\"path\": ";
+			appendJsonString(out, slowest[item][i].path);
+			out += ", \"seconds\": " + std::string(number) + "}";
+		}
+		out += slowest[item].empty() ? "]\n" : "\n\t\t]\n";
+		out += (item + 1 < ItemCount) ? "\t},\n" : "\t}\n";
+	}
+	out += "}\n";
+
+	bool failed = out.size() != fwrite(out.data(), 1, out.size(), file);
+	failed = (0 != fclose(file)) || failed;
+	file = nullptr;
+	if(failed)
+	{
+		fprintf(stderr, "Error %s writing profile %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to write profile");
+	}
+}
+
+// The number for a directory's prefix, usually just the next from gDirCounter
+int directoryNumber(const std::filesystem::path &dir);
+
+std::string makePrefix(const std::filesystem::path &path, int dirNumber)
+{
+	char prefix[70];
+	std::string folder = path.filename().string();
+	if(searchRegexes(folder, maskPathRegexes))
+	{
+		folder = "folder";
+	}
+	
+	if(path.has_parent_path())
+	{
+		std::string parent = path.parent_path().filename();
+		if(searchRegexes(parent, maskPathRegexes))
+		{
+			parent = "folder";
+		}
+		snprintf(prefix, sizeof(prefix), "dir%07d/%s/%s", dirNumber, parent.c_str(), folder.c_str());
+	}
+	else
+	{
+		snprintf(prefix, sizeof(prefix), "dir%07d/%s", dirNumber, folder.c_str());
+	}
+	return prefix;
+}
+
+class ArchiveWriter;
+
+// The archive split into volumes, for --split-size and --volumes.  Each
+// volume is a tar archive of its own, compressed on its own if at all, with
+// its own hard links for --dedup, and every dirNNNNNNN directory is kept
+// whole within one volume.  "lanes" volumes are written at once, each by a
+// thread of its own and each to the next of the destination directories in
+// turn, with every directory going to the lane with the least assigned to
+// it.  A lane starts on its next volume before a directory would take the
+// one it is writing past "splitSize" bytes, counted before compression;
+// a directory bigger than that gets a volume to itself.
+//
+// Volume names are the output path's name with a number before its ".tar",
+// or after it without one.  Lane l writes volumes l+1, l+1+lanes and so on,
+// so that with --deterministic the same volumes come out every time.  An
+// index of which volume holds each directory is written to the output path
+// with ".index" on the end.
+class VolumeSet
+{
+public:
+	struct Settings
+	{
+		std::filesystem::path output;
+		std::vector<std::filesystem::path> dirs;	// Beside the output path if empty
+		int lanes;
+		off_t splitSize;	// 0 for no limit
+		int directIO;
+		OutputFile::FlushPolicy flushPolicy;
+		off_t syncInterval;
+		Compressor::Format compression;
+		int compressLevel;
+		int compressThreads;
+		unsigned readAheadDepth;
+		bool dedup;
+	};
+
+	struct File
+	{
+		std::filesystem::path source;
+		struct stat statbuf;
+	};
+
+	VolumeSet(const Settings &settings, Manifest *manifest, int verbose);
+	~VolumeSet();
+
+	// Queue one directory's files for whichever lane has the least to do
+	void add(const std::string &prefix, std::vector<File> files);
+
+	// Write everything still queued, end the last volumes and write the
+	// index.  Throws if any lane failed.
+	void finish();
+
+private:
+	struct Batch
+	{
+		std::string prefix;	// A copy, as lanes may outlive the ArchiveWriter
+		std::vector<File> files;
+		off_t size;		// In the tar, before compression
+	};
+
+	// A line of the index
+	struct Record
+	{
+		int volume;
+		std::string prefix;
+		std::string path;
+		size_t files;
+		off_t bytes;
+	};
+
+	struct Lane
+	{
+		std::thread thread;
+		std::deque<Batch> batches;
+		uint64_t assigned = 0;	// Bytes ever queued, to balance lanes by
+
+		// Only touched by the lane's thread
+		int sequence = 0;
+		int volume = 0;
+		std::filesystem::path path;
+		std::unique_ptr<OutputFile> outfile;
+		std::unique_ptr<ArchiveWriter> writer;
+		off_t size = 0;
+		std::vector<Record> records;
+	};
+
+	void run(size_t lane);
+	void startVolume(Lane &lane, size_t index);
+	void endVolume(Lane &lane);
+
+	Settings settings;
+	Manifest *manifest;
+	int verbose;
+	FILE *index;
+
+	std::vector<Lane> lanes;
+	std::mutex lock;
+	std::condition_variable wake;
+	size_t queued = 0;
+	bool done = false;
+	std::exception_ptr error;
+
+	static const size_t queueLimit = 256;
+};
+
+// Where matched files go on their way into the tarball.  A normal scan writes
+// each file as soon as it is found; with --jobs the scanning threads queue
+// files for a single writer thread instead, so that no scanner ever waits on
+// archive I/O and the tarball only ever has one writer.
+//
+// With --deterministic nothing is written until the scan is over.  Matches
+// are collected in a lock-free list, sorted by path in bounded chunks that
+// are spilled to temporary files, and merged back when the scan finishes.
+// Directory numbers are only handed out during that merge, so they follow
+// path order rather than the order in which threads found things.
+//
+// With --read-ahead, files are started on a ReadAhead engine as they are
+// queued and only written once they fall out of the read-ahead window.
+//
+// When the archive is split into volumes, nothing is written here at all.
+// Each directory's files are gathered until endDirectory(), or the merge
+// moves on to the next directory, and handed to the VolumeSet whole.
+//
+// With --checkpoint, whichever thread writes the archive journals files as
+// they are written and directories as their records come up behind their
+// files, and commits the journal when one is due, having written out the
+// read-ahead window and the batch first.
+class ArchiveWriter
+{
+public:
+	ArchiveWriter(OutputFile &outfile, bool threaded, bool sorted, unsigned readAheadDepth, bool dedup, Manifest *manifest, bool dryRun, VolumeSet *volumes, int verbose);
+	~ArchiveWriter();
+
+	// Begin a new dirNNNNNNN directory in the archive for files from
+	// "source", returning the prefix to pass to add()
+	const std::string &startDirectory(const std::filesystem::path &source);
+
+	// The one copy of a prefix kept for as long as the archive is written,
+	// for prefixes that didn't come from startDirectory()
+	const std::string &intern(const std::string &prefix);
+
+	// Add a file under a prefix from startDirectory() or intern()
+	void add(const std::filesystem::path &source, const struct stat &statbuf, const std::string &prefix);
+
+	// Called once every file under a prefix has been added, to hand the
+	// directory to the volumes or write out its batch of small files
+	void endDirectory(const std::string &prefix);
+
+	// Journal a directory's record from Checkpoint::describe() once
+	// everything it added so far is in the archive
+	void directoryDone(std::string record);
+
+	// Write out anything still queued, stop the writer thread and end the
+	// archive.  Throws if the writer thread failed.
+	void finish();
+
+	// Files handed to the archive so far, and their total size
+	uint64_t fileCount() const { return files; }
+	uint64_t byteCount() const { return bytes; }
+
+	// How many more bytes of files could be added before the writer falls
+	// "limit" behind, for --prefetch.  None if files aren't written as they
+	// are added.
+	uint64_t room(uint64_t limit) const;
+
+private:
+	struct Item
+	{
+		std::filesystem::path source;
+		struct stat statbuf;
+		const std::string *prefix;	// Interned, so items share it
+		std::string done = {};	// Instead of a file, a record for directoryDone()
+	};
+
+	// A --deterministic match.  "key" is the directory path, a NUL, the
+	// filename, another NUL and the file's struct stat, so that sorting keys
+	// sorts files by directory first.
+	struct Match
+	{
+		std::string key;
+		Match *next;
+	};
+
+	// A file in the read-ahead window.  A duplicate for --dedup waits its
+	// turn too, so that it never comes ahead of the file it links to.
+	struct Pending
+	{
+		Item item;
+		std::string tarName;
+		std::shared_ptr<PrefetchedFile> file;
+		std::string linkTarget;
+	};
+
+	// A small file waiting to be written with others from its directory
+	struct Batched
+	{
+		Item item;
+		std::string tarName;
+	};
+
+	// Everything finish() does but end the archive
+	void stop();
+	void enqueue(Item item);
+	void checkpointIfDue();
+	void write(Item item);
+	void batchFile(Item item, std::string tarName);
+	void writeBatch();
+	void writeFront();
+	void drainWindow();
+	void run();
+	void spill();
+	std::vector<std::string> takeMatches();
+	void writeSorted();
+
+	OutputFile &outfile;
+	int verbose;
+
+	// Every prefix handed out, once each.  The set's nodes never move, so
+	// items can point at them.
+	std::mutex prefixLock;
+	std::unordered_set<std::string> prefixes;
+
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<Item> queue;
+	bool done = false;
+	std::exception_ptr error;
+
+	static const size_t queueLimit = 4096;
+
+	bool sorted;
+	bool finished = false;
+	bool ended = false;
+	std::atomic<Match *> matches{nullptr};
+	std::atomic<size_t> matchCount{0};
+	std::mutex spillLock;
+	std::vector<FILE *> runs;
+
+	static const size_t chunkLimit = 65536;
+
+	// Declared in this order so that the engine finishes with the
+	// window's buffers before they are freed
+	std::deque<Pending> window;
+	size_t windowBytes = 0;
+	unsigned readAheadDepth;
+	std::unique_ptr<ReadAhead> readAhead;
+
+	static const size_t windowByteLimit = 64 * 1024 * 1024;
+
+	// Without --read-ahead, small files from one directory are gathered
+	// and written together.  Declared in the same order as the window, for
+	// the same reason.
+	std::vector<Batched> batch;
+	std::vector<std::shared_ptr<PrefetchedFile>> batchReads;
+	size_t batchBytes = 0;
+	std::unique_ptr<ReadAhead> batchReader;
+
+	static const off_t smallFileSize = 64 * 1024;
+	static const size_t batchFileLimit = 64;
+	static constexpr size_t batchByteLimit = OutputFile::bufferSize / 2 - smallFileSize - 1024;
+
+	std::unique_ptr<DuplicateFinder> duplicates;
+
+	Manifest *manifest;
+	bool dryRun;
+	uint64_t files = 0;
+	uint64_t bytes = 0;
+	std::atomic<uint64_t> addedBytes{0};
+	std::atomic<uint64_t> writtenBytes{0};
+
+	// Directories still being gathered for the volumes, by prefix
+	VolumeSet *volumes;
+	std::mutex gatherLock;
+	std::unordered_map<const std::string *, std::vector<VolumeSet::File>> gathering;
+};
+
+ArchiveWriter::ArchiveWriter(OutputFile &outfile, bool threaded, bool sorted, unsigned readAheadDepth, bool dedup, Manifest *manifest, bool dryRun, VolumeSet *volumes, int verbose) : outfile(outfile), verbose(verbose), sorted(sorted), readAheadDepth(readAheadDepth), manifest(manifest), dryRun(dryRun), volumes(volumes)
+{
+	// With volumes, their own writers do the reading and linking
+	if(dedup && !volumes)
+	{
+		duplicates = std::make_unique<DuplicateFinder>();
+	}
+	if(readAheadDepth > 0 && !volumes)
+	{
+		readAhead = ReadAhead::create(readAheadDepth);
+	}
+	else if(!volumes && !dryRun)
+	{
+		batchReader = UringReadAhead::create(batchFileLimit);
+		if(!batchReader)
+		{
+			batchReader = std::make_unique<DeferredReadAhead>();
+		}
+	}
+	if(threaded && !sorted && !volumes)
+	{
+		writer = std::thread(&ArchiveWriter::run, this);
+	}
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+	// An archive given up on isn't ended, so it can't pass for complete
+	try
+	{
+		stop();
+	}
+	catch(std::exception &e)
+	{
+	}
+
+	for(Match *match = matches.exchange(nullptr); match; )
+	{
+		Match *next = match->next;
+		delete match;
+		match = next;
+	}
+	for(FILE *run : runs)
+	{
+		fclose(run);
+	}
+}
+
+const std::string &ArchiveWriter::startDirectory(const std::filesystem::path &source)
+{
+	// --deterministic numbers the directories as they are written
+	if(sorted)
+	{
+		return intern(std::string());
+	}
+	return intern(makePrefix(source, directoryNumber(source)));
+}
+
+const std::string &ArchiveWriter::intern(const std::string &prefix)
+{
+	std::lock_guard<std::mutex> guard(prefixLock);
+	return *prefixes.insert(prefix).first;
+}
+
+void ArchiveWriter::add(const std::filesystem::path &source, const struct stat &statbuf, const std::string &prefix)
+{
+	Stats::add(Stats::Matches);
+	addedBytes += statbuf.st_size;
+	if(sorted)
+	{
+		Match *match = new Match{source.parent_path().native(), matches.load()};
+		match->key += '\0';
+		match->key += source.filename().native();
+		match->key += '\0';
+		match->key.append((const char *)&statbuf, sizeof(statbuf));
+		while(!matches.compare_exchange_weak(match->next, match))
+		{
+		}
+		if(++matchCount % chunkLimit == 0)
+		{
+			spill();
+		}
+		return;
+	}
+
+	if(volumes)
+	{
+		std::lock_guard<std::mutex> guard(gatherLock);
+		gathering[&prefix].push_back({source, statbuf});
+		return;
+	}
+
+	if(!writer.joinable())
+	{
+		write({source, statbuf, &prefix});
+		checkpointIfDue();
+		return;
+	}
+	enqueue({source, statbuf, &prefix});
+}
+
+void ArchiveWriter::enqueue(Item item)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	wake.wait(guard, [this]{ return queue.size() < queueLimit || error; });
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+	queue.push_back(std::move(item));
+	wake.notify_all();
+}
+
+uint64_t ArchiveWriter::room(uint64_t limit) const
+{
+	if(sorted || volumes || dryRun)
+	{
+		return 0;
+	}
+	// Written first, so that it can't have overtaken what was added
+	uint64_t written = writtenBytes;
+	uint64_t behind = addedBytes - written;
+	return (behind < limit) ? limit - behind : 0;
+}
+
+void ArchiveWriter::endDirectory(const std::string &prefix)
+{
+	if(sorted)
+	{
+		return;
+	}
+	if(!volumes)
+	{
+		// Without a writer thread the batch is the caller's to write, and
+		// needn't wait for the next directory to come along
+		if(!writer.joinable())
+		{
+			writeBatch();
+		}
+		return;
+	}
+	std::vector<VolumeSet::File> directory;
+	{
+		std::lock_guard<std::mutex> guard(gatherLock);
+		auto found = gathering.find(&prefix);
+		if(found == gathering.end())
+		{
+			return;
+		}
+		directory = std::move(found->second);
+		gathering.erase(found);
+	}
+	volumes->add(prefix, std::move(directory));
+}
+
+void ArchiveWriter::directoryDone(std::string record)
+{
+	// The writer thread gets it behind the directory's files
+	if(writer.joinable())
+	{
+		enqueue({{}, {}, nullptr, std::move(record)});
+		return;
+	}
+	gCheckpoint->append(record);
+	checkpointIfDue();
+}
+
+// Commit the journal, with every file handed to write() so far in the archive
+void ArchiveWriter::checkpointIfDue()
+{
+	if(!gCheckpoint || !gCheckpoint->due())
+	{
+		return;
+	}
+	drainWindow();
+	writeBatch();
+	off_t archiveLength = outfile.checkpoint();
+	gCheckpoint->commit(archiveLength, manifest ? manifest->checkpoint() : -1);
+}
+
+void ArchiveWriter::finish()
+{
+	stop();
+	if(volumes)
+	{
+		// Nothing should be left, but a directory never ended is still
+		// kept whole
+		std::lock_guard<std::mutex> guard(gatherLock);
+		for(auto &directory : gathering)
+		{
+			volumes->add(*directory.first, std::move(directory.second));
+		}
+		gathering.clear();
+	}
+	else if(!ended)
+	{
+		// Two zero blocks end a tar archive
+		ended = true;
+		outfile.writeZeros(2 * 512);
+	}
+}
+
+void ArchiveWriter::stop()
+{
+	if(sorted && !finished)
+	{
+		finished = true;
+		writeSorted();
+	}
+	if(!writer.joinable() && !error)
+	{
+		drainWindow();
+		writeBatch();
+	}
+	if(writer.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			done = true;
+		}
+		wake.notify_all();
+		writer.join();
+	}
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+void ArchiveWriter::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		wake.wait(guard, [this]{ return !queue.empty() || done || !window.empty(); });
+		if(queue.empty() && window.empty() && batch.empty())
+		{
+			break;
+		}
+		bool haveItem = !queue.empty();
+		Item item;
+		if(haveItem)
+		{
+			item = std::move(queue.front());
+			queue.pop_front();
+			wake.notify_all();
+		}
+
+		guard.unlock();
+		try
+		{
+			// With nothing new queued, get on with the window instead
+			// of waiting.  A batch is only cut short at the end, or it
+			// would rarely get past one file.
+			if(haveItem)
+			{
+				write(std::move(item));
+				checkpointIfDue();
+			}
+			else if(!window.empty())
+			{
+				writeFront();
+			}
+			else
+			{
+				writeBatch();
+			}
+		}
+		catch(std::exception &e)
+		{
+			guard.lock();
+			error = std::current_exception();
+			queue.clear();
+			wake.notify_all();
+			break;
+		}
+		guard.lock();
+	}
+}
+
+// Archive a file, or with --read-ahead start reading it and archive whatever
+// falls out of the window
+void ArchiveWriter::write(Item item)
+{
+	if(!item.done.empty())
+	{
+		gCheckpoint->append(item.done);
+		return;
+	}
+	files++;
+	bytes += item.statbuf.st_size;
+	writtenBytes += item.statbuf.st_size;
+	std::string_view filename = lastComponent(item.source.native());
+	std::string tarName;
+	tarName.reserve(item.prefix->size() + 1 + filename.size());
+	tarName += *item.prefix;
+	tarName += '/';
+	tarName += filename;
+	if(manifest)
+	{
+		manifest->add(item.source, tarName, item.statbuf);
+	}
+	if(dryRun)
+	{
+		return;
+	}
+	if(gCheckpoint)
+	{
+		gCheckpoint->fileAdded(item.source.native());
+	}
+
+	std::string linkTarget;
+	if(duplicates)
+	{
+		linkTarget = duplicates->findOriginal(item.source, item.statbuf);
+		if(!linkTarget.empty())
+		{
+			printIfVerbose(verbose, "Duplicate of %s: %s\n", linkTarget.c_str(), item.source.c_str());
+		}
+	}
+	if(!readAhead)
+	{
+		if(linkTarget.empty() && item.statbuf.st_size <= smallFileSize)
+		{
+			batchFile(std::move(item), std::move(tarName));
+			return;
+		}
+		writeBatch();
+		if(linkTarget.empty())
+		{
+			if(addFileToTar(item.source, item.statbuf, tarName, outfile, verbose) && duplicates)
+			{
+				duplicates->archived(item.source, item.statbuf, tarName);
+			}
+		}
+		else
+		{
+			addLinkToTar(tarName, linkTarget, item.statbuf, outfile);
+		}
+		return;
+	}
+	std::shared_ptr<PrefetchedFile> file = linkTarget.empty() ? readAhead->start(item.source, item.statbuf) : nullptr;
+	readAhead->push();
+	windowBytes += file ? file->wanted : 0;
+	window.push_back({std::move(item), std::move(tarName), file, std::move(linkTarget)});
+	while(window.size() > readAheadDepth || windowBytes > windowByteLimit)
+	{
+		writeFront();
+	}
+}
+
+void ArchiveWriter::writeFront()
+{
+	Pending pending = std::move(window.front());
+	window.pop_front();
+	if(pending.file)
+	{
+		Profile::ItemTimer itemTimer(Profile::File, pending.item.source);
+		windowBytes -= pending.file->wanted;
+		{
+			Profile::Timer timer(Profile::ReadFile);
+			readAhead->wait(*pending.file);
+		}
+		// An original that was still in the window when this file was
+		// queued may have reached the archive since
+		std::string linkTarget = duplicates ? duplicates->findOriginal(pending.item.source, pending.item.statbuf) : std::string();
+		if(!linkTarget.empty())
+		{
+			printIfVerbose(verbose, "Duplicate of %s: %s\n", linkTarget.c_str(), pending.item.source.c_str());
+			addLinkToTar(pending.tarName, linkTarget, pending.item.statbuf, outfile);
+		}
+		else if(addFileToTar(pending.item.source, pending.tarName, outfile, verbose, *pending.file) && duplicates)
+		{
+			duplicates->archived(pending.item.source, pending.item.statbuf, pending.tarName);
+		}
+	}
+	else if(!pending.linkTarget.empty())
+	{
+		addLinkToTar(pending.tarName, pending.linkTarget, pending.item.statbuf, outfile);
+	}
+	else
+	{
+		if(addFileToTar(pending.item.source, pending.item.statbuf, pending.tarName, outfile, verbose) && duplicates)
+		{
+			duplicates->archived(pending.item.source, pending.item.statbuf, pending.tarName);
+		}
+	}
+}
+
+void ArchiveWriter::batchFile(Item item, std::string tarName)
+{
+	if(!batch.empty() && batch.front().item.prefix != item.prefix)
+	{
+		writeBatch();
+	}
+	batchBytes += 512 + (item.statbuf.st_size + 511) / 512 * 512;
+	batch.push_back({std::move(item), std::move(tarName)});
+	if(batch.size() == batchFileLimit || batchBytes >= batchByteLimit)
+	{
+		writeBatch();
+	}
+}
+
+// Write the batch in one piece.  The headers and padding are laid out in the
+// output buffer and the files read straight into place between them, all at
+// once where io_uring allows, so that the batch costs one write and one flush
+// however many files are in it.
+void ArchiveWriter::writeBatch()
+{
+	if(batch.empty())
+	{
+		return;
+	}
+	unsigned char *dest = outfile.reserveWhole(batchBytes);
+	batchReads.clear();
+	size_t offset = 0;
+	{
+		Profile::Timer timer(Profile::ReadFile);
+		for(auto &file : batch)
+		{
+			makeTarHeader(dest + offset, file.tarName, file.item.statbuf);
+			batchReads.push_back(batchReader->start(file.item.source, file.item.statbuf, dest + offset + 512));
+			offset += 512 + (file.item.statbuf.st_size + 511) / 512 * 512;
+		}
+		batchReader->push();
+	}
+
+	// Move each entry down over any before it that couldn't be opened.
+	// Nothing moves until its own read is done.
+	size_t from = 0, to = 0;
+	for(size_t i = 0; i < batch.size(); i++)
+	{
+		PrefetchedFile &file = *batchReads[i];
+		size_t size = 512 + (file.statbuf.st_size + 511) / 512 * 512;
+		{
+			Profile::Timer timer(Profile::ReadFile);
+			batchReader->wait(file);
+		}
+		if(file.openErrno)
+		{
+			fprintf(stderr, "Open error %s for file %s when adding to archive\n", strerror(file.openErrno), batch[i].item.source.c_str());
+			Stats::add(Stats::Errors);
+			from += size;
+			continue;
+		}
+		if(file.readErrno)
+		{
+			fprintf(stderr, "Read error %s for file %s when adding to archive\n", strerror(file.readErrno), batch[i].item.source.c_str());
+			throw std::runtime_error("Error reading input file");
+		}
+		// Pad out a file that shrank, and the last block
+		memset(dest + from + 512 + file.length, 0, size - 512 - file.length);
+		if(from != to)
+		{
+			memmove(dest + to, dest + from, size);
+		}
+		Stats::add(Stats::BytesRead, file.length);
+		if(duplicates)
+		{
+			duplicates->archived(batch[i].item.source, batch[i].item.statbuf, batch[i].tarName);
+		}
+		from += size;
+		to += size;
+	}
+	outfile.commit(to);
+	outfile.fileDone();
+	batch.clear();
+	batchReads.clear();
+	batchBytes = 0;
+}
+
+void ArchiveWriter::drainWindow()
+{
+	while(!window.empty())
+	{
+		writeFront();
+	}
+}
+
+// Detach everything collected so far from the lock-free list
+std::vector<std::string> ArchiveWriter::takeMatches()
+{
+	std::vector<std::string> keys;
+	for(Match *match = matches.exchange(nullptr); match; )
+	{
+		keys.push_back(std::move(match->key));
+		Match *next = match->next;
+		delete match;
+		match = next;
+	}
+	return keys;
+}
+
+// Sort the matches collected so far and write them to a temporary file as
+// one run of the final merge
+void ArchiveWriter::spill()
+{
+	std::lock_guard<std::mutex> guard(spillLock);
+	std::vector<std::string> keys = takeMatches();
+	std::sort(keys.begin(), keys.end());
+
+	FILE *run = tmpfile();
+	if(!run)
+	{
+		fprintf(stderr, "Error %s creating temporary sort file\n", strerror(errno));
+		throw std::runtime_error("Error creating temporary file");
+	}
+	runs.push_back(run);
+	for(auto &key : keys)
+	{
+		uint32_t length = key.length();
+		if(fwrite(&length, sizeof(length), 1, run) != 1 || fwrite(key.data(), 1, length, run) != length)
+		{
+			fprintf(stderr, "Write error %s on temporary sort file\n", strerror(errno));
+			throw std::runtime_error("Error writing temporary file");
+		}
+	}
+	if(fflush(run) != 0 || fseek(run, 0, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "Error %s rewinding temporary sort file\n", strerror(errno));
+		throw std::runtime_error("Error writing temporary file");
+	}
+}
+
+// Merge the spilled runs and whatever is still in memory, archiving files in
+// path order and numbering each directory as it comes up
+void ArchiveWriter::writeSorted()
+{
+	std::lock_guard<std::mutex> guard(spillLock);
+	std::vector<std::string> memoryRun = takeMatches();
+	std::sort(memoryRun.begin(), memoryRun.end());
+	size_t memoryNext = 0;
+
+	// Fetch the next key from run "index", where index runs.size() is the
+	// in-memory run
+	auto next = [&](size_t index, std::string &key) -> bool
+	{
+		if(index == runs.size())
+		{
+			if(memoryNext == memoryRun.size())
+			{
+				return false;
+			}
+			key = std::move(memoryRun[memoryNext++]);
+			return true;
+		}
+		uint32_t length;
+		if(fread(&length, sizeof(length), 1, runs[index]) != 1)
+		{
+			return false;
+		}
+		key.resize(length);
+		if(fread(&key[0], 1, length, runs[index]) != length)
+		{
+			fprintf(stderr, "Read error %s on temporary sort file\n", strerror(errno));
+			throw std::runtime_error("Error reading temporary file");
+		}
+		return true;
+	};
+
+	typedef std::pair<std::string, size_t> Head;
+	std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+	for(size_t i = 0; i <= runs.size(); i++)
+	{
+		std::string key;
+		if(next(i, key))
+		{
+			heads.emplace(std::move(key), i);
+		}
+	}
+
+	std::string currentDir;
+	const std::string *prefix = nullptr;
+	bool first = true;
+	std::vector<VolumeSet::File> directory;
+	while(!heads.empty())
+	{
+		Head head = heads.top();
+		heads.pop();
+
+		size_t separator = head.first.find('\0');
+		size_t statStart = head.first.length() - sizeof(struct stat);
+		std::string dir = head.first.substr(0, separator);
+		struct stat statbuf;
+		memcpy(&statbuf, head.first.data() + statStart, sizeof(statbuf));
+		if(first || dir != currentDir)
+		{
+			if(!directory.empty())
+			{
+				volumes->add(*prefix, std::move(directory));
+				directory.clear();
+			}
+			first = false;
+			currentDir = dir;
+			prefix = &intern(makePrefix(dir, directoryNumber(dir)));
+		}
+		std::filesystem::path source = std::filesystem::path(dir) / head.first.substr(separator + 1, statStart - 1 - (separator + 1));
+		if(volumes)
+		{
+			directory.push_back({std::move(source), statbuf});
+		}
+		else
+		{
+			write({std::move(source), statbuf, prefix});
+		}
+
+		std::string key;
+		if(next(head.second, key))
+		{
+			heads.emplace(std::move(key), head.second);
+		}
+	}
+	if(!directory.empty())
+	{
+		volumes->add(*prefix, std::move(directory));
+	}
+}
+
+VolumeSet::VolumeSet(const Settings &settings, Manifest *manifest, int verbose) : settings(settings), manifest(manifest), verbose(verbose), lanes(settings.lanes)
+{
+	// Created up front, like the manifest, so that a clash shows straight away
+	std::string indexName = settings.output.native() + ".index";
+	index = fopen(indexName.c_str(), "wx");
+	if(!index)
+	{
+		fprintf(stderr, "Error %s opening volume index %s\n", strerror(errno), indexName.c_str());
+		throw std::runtime_error("Failed to open volume index");
+	}
+	for(size_t i = 0; i < lanes.size(); i++)
+	{
+		lanes[i].thread = std::thread(&VolumeSet::run, this, i);
+	}
+}
+
+VolumeSet::~VolumeSet()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+		if(!error)
+		{
+			// Given up on, so stop rather than finish the volumes
+			error = std::make_exception_ptr(std::runtime_error("Archive abandoned"));
+		}
+	}
+	wake.notify_all();
+	for(auto &lane : lanes)
+	{
+		if(lane.thread.joinable())
+		{
+			lane.thread.join();
+		}
+	}
+	if(index)
+	{
+		fclose(index);
+	}
+}
+
+void VolumeSet::add(const std::string &prefix, std::vector<File> files)
+{
+	off_t size = 0;
+	for(auto &file : files)
+	{
+		size += 512 + (file.statbuf.st_size + 511) / 512 * 512;
+	}
+
+	std::unique_lock<std::mutex> guard(lock);
+	wake.wait(guard, [this]{ return queued < queueLimit || error; });
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+	Lane *lightest = &lanes[0];
+	for(auto &lane : lanes)
+	{
+		if(lane.assigned < lightest->assigned)
+		{
+			lightest = &lane;
+		}
+	}
+	lightest->assigned += size;
+	lightest->batches.push_back({prefix, std::move(files), size});
+	queued++;
+	wake.notify_all();
+}
+
+void VolumeSet::finish()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+	wake.notify_all();
+	for(auto &lane : lanes)
+	{
+		lane.thread.join();
+	}
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+
+	std::vector<Record> records;
+	for(auto &lane : lanes)
+	{
+		records.insert(records.end(), lane.records.begin(), lane.records.end());
+	}
+	std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) { return a.volume < b.volume; });
+	std::string line;
+	for(auto &record : records)
+	{
+		line = "{\"dir\":";
+		appendJsonString(line, record.prefix);
+		line += ",\"volume\":";
+		appendJsonString(line, record.path);
+		line += ",\"files\":" + std::to_string(record.files);
+		line += ",\"bytes\":" + std::to_string(record.bytes);
+		line += "}\n";
+		if(line.size() != fwrite(line.data(), 1, line.size(), index))
+		{
+			break;
+		}
+	}
+	bool failed = ferror(index) || (0 != fflush(index)) || (0 != fsync(fileno(index)));
+	failed = (0 != fclose(index)) || failed;
+	index = nullptr;
+	if(failed)
+	{
+		fprintf(stderr, "Error %s writing volume index %s.index\n", strerror(errno), settings.output.c_str());
+		throw std::runtime_error("Failed to write volume index");
+	}
+}
+
+void VolumeSet::run(size_t index)
+{
+	Lane &lane = lanes[index];
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		wake.wait(guard, [&]{ return !lane.batches.empty() || done || error; });
+		if(error || lane.batches.empty())
+		{
+			break;
+		}
+		Batch batch = std::move(lane.batches.front());
+		lane.batches.pop_front();
+		queued--;
+		wake.notify_all();
+
+		guard.unlock();
+		try
+		{
+			// Two zero blocks will end the volume
+			if(lane.writer && settings.splitSize && lane.size + batch.size + 1024 > settings.splitSize)
+			{
+				endVolume(lane);
+			}
+			if(!lane.writer)
+			{
+				startVolume(lane, index);
+			}
+			// "batch" goes at the end of the loop, so the writer gets a
+			// prefix that lasts as long as it does
+			const std::string &prefix = lane.writer->intern(batch.prefix);
+			for(auto &file : batch.files)
+			{
+				lane.writer->add(file.source, file.statbuf, prefix);
+			}
+			lane.writer->endDirectory(prefix);
+			lane.size += batch.size;
+			off_t bytes = 0;
+			for(auto &file : batch.files)
+			{
+				bytes += file.statbuf.st_size;
+			}
+			lane.records.push_back({lane.volume, batch.prefix, lane.path.native(), batch.files.size(), bytes});
+		}
+		catch(std::exception &e)
+		{
+			guard.lock();
+			if(!error)
+			{
+				error = std::current_exception();
+			}
+			wake.notify_all();
+			break;
+		}
+		guard.lock();
+	}
+	if(!error && lane.writer)
+	{
+		guard.unlock();
+		try
+		{
+			endVolume(lane);
+		}
+		catch(std::exception &e)
+		{
+			guard.lock();
+			if(!error)
+			{
+				error = std::current_exception();
+			}
+			wake.notify_all();
+		}
+	}
+}
+
+void VolumeSet::startVolume(Lane &lane, size_t index)
+{
+	lane.volume = lane.sequence++ * lanes.size() + index + 1;
+	char number[16];
+	snprintf(number, sizeof(number), ".%03d", lane.volume);
+	std::string name = settings.output.filename().native();
+	size_t extension = name.find(".tar");
+	name.insert(extension == std::string::npos ? name.length() : extension, number);
+	std::filesystem::path dir = settings.dirs.empty() ? settings.output.parent_path() : settings.dirs[index % settings.dirs.size()];
+	lane.path = dir / name;
+
+	printIfVerbose(verbose, "Starting volume %s\n", lane.path.c_str());
+	int directIO = settings.directIO;
+	int fd = createOutput(lane.path, directIO);
+	if(fd == -1)
+	{
+		throw std::runtime_error("Failed to create volume");
+	}
+	lane.outfile = std::make_unique<OutputFile>(fd, directIO, settings.flushPolicy, settings.syncInterval);
+	lane.outfile->compress(settings.compression, settings.compressLevel, std::max(1, settings.compressThreads / settings.lanes));
+	lane.writer = std::make_unique<ArchiveWriter>(*lane.outfile, false, false, settings.readAheadDepth, settings.dedup, manifest, false, nullptr, verbose);
+	lane.size = 0;
+}
+
+void VolumeSet::endVolume(Lane &lane)
+{
+	lane.writer->finish();
+	lane.writer.reset();
+	lane.outfile->close();
+	lane.outfile.reset();
+}
+
+// One entry in a directory.  The name lives in its DirListing's arena, with
+// a NUL after it, so that it can be handed straight to the *at() calls.
+struct DirEntry
+{
+	std::string_view name;
+	unsigned char type;	// DT_* from getdents64, which may be DT_UNKNOWN
+};
+
+// Storage for names, handed out from 64 KiB blocks that never move, so that
+// views into it stay good until reset().  The blocks are kept when it is
+// reset, so an arena reused from one directory to the next soon stops
+// allocating altogether.
+class NameArena
+{
+public:
+	// Copy a name in, NUL-terminated
+	std::string_view add(std::string_view name)
+	{
+		if(name.size() + 1 > left)
+		{
+			if(nextBlock == blocks.size())
+			{
+				blocks.emplace_back(new char[blockSize]);
+			}
+			next = blocks[nextBlock++].get();
+			left = blockSize;
+		}
+		memcpy(next, name.data(), name.size());
+		next[name.size()] = '\0';
+		std::string_view copy(next, name.size());
+		next += name.size() + 1;
+		left -= name.size() + 1;
+		return copy;
+	}
+
+	void reset()
+	{
+		nextBlock = 0;
+		left = 0;
+	}
+
+private:
+	static const size_t blockSize = 64 * 1024;	// Far more than NAME_MAX
+
+	std::vector<std::unique_ptr<char[]>> blocks;
+	size_t nextBlock = 0;
+	char *next = nullptr;
+	size_t left = 0;
+};
+
+// A directory's entries along with the arena their names are kept in.  Each
+// scanning thread reuses its listings from one directory to the next.
+struct DirListing
+{
+	std::vector<DirEntry> entries;
+	NameArena names;
+
+	void clear()
+	{
+		entries.clear();
+		names.reset();
+	}
+
+	void add(std::string_view name, unsigned char type)
+	{
+		entries.push_back({names.add(name), type});
+	}
+};
+
+// Read every entry of an open directory apart from "." and "..", in one
+// getdents64 call per 64 KiB of entries.  Returns false with errno set if the
+// directory couldn't be read.
+bool listDirectory(int fd, DirListing &listing)
+{
+	static thread_local std::vector<char> buffer(64 * 1024);
+	listing.clear();
+	if(lseek(fd, 0, SEEK_SET) != 0)
+	{
+		return false;
+	}
+	while(true)
+	{
+		ssize_t length = getdents64(fd, buffer.data(), buffer.size());
+		if(length < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(length < 0)
+		{
+			return false;
+		}
+		if(length == 0)
+		{
+			return true;
+		}
+		for(ssize_t offset = 0; offset < length; )
+		{
+			struct dirent64 *entry = (struct dirent64 *)(buffer.data() + offset);
+			offset += entry->d_reclen;
+			if(0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+			{
+				continue;
+			}
+			listing.add(entry->d_name, entry->d_type);
+		}
+	}
+}
+
+// fstatat(), timed for --profile
+int statAt(int dirfd, const char *name, struct stat *statbuf, int flags)
+{
+	Profile::Timer timer(Profile::StatFile);
+	return fstatat(dirfd, name, statbuf, flags);
+}
+
+// The type of a directory entry, only asking the filesystem if getdents64
+// couldn't tell us.  "name" is relative to "dirfd", as for fstatat().
+unsigned char entryType(int dirfd, const char *name, unsigned char type)
+{
+	if(type != DT_UNKNOWN)
+	{
+		return type;
+	}
+	struct stat statbuf;
+	if(0 != statAt(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW))
+	{
+		return DT_UNKNOWN;
+	}
+	return IFTODT(statbuf.st_mode);
+}
+
+// A statx result as fstatat() would have put it
+void statxToStat(const struct statx &from, struct stat &to)
+{
+	memset(&to, 0, sizeof(to));
+	to.st_dev = makedev(from.stx_dev_major, from.stx_dev_minor);
+	to.st_ino = from.stx_ino;
+	to.st_mode = from.stx_mode;
+	to.st_nlink = from.stx_nlink;
+	to.st_uid = from.stx_uid;
+	to.st_gid = from.stx_gid;
+	to.st_rdev = makedev(from.stx_rdev_major, from.stx_rdev_minor);
+	to.st_size = from.stx_size;
+	to.st_blksize = from.stx_blksize;
+	to.st_blocks = from.stx_blocks;
+	to.st_atim.tv_sec = from.stx_atime.tv_sec;
+	to.st_atim.tv_nsec = from.stx_atime.tv_nsec;
+	to.st_mtim.tv_sec = from.stx_mtime.tv_sec;
+	to.st_mtim.tv_nsec = from.stx_mtime.tv_nsec;
+	to.st_ctim.tv_sec = from.stx_ctime.tv_sec;
+	to.st_ctim.tv_nsec = from.stx_ctime.tv_nsec;
+}
+
+// stat() every one of "names" in the directory open as "dirfd", with
+// fstatat()'s "flags".  errors[i] is 0 where results[i] was filled in, and
+// the errno otherwise.
+//
+// With --prefetch, the statx calls are handed to io_uring together and run
+// concurrently, so that a cold disk or a network filesystem works through
+// them as one queue of requests rather than a round trip each.  Otherwise, or
+// where io_uring or its statx isn't available, they are made in turn.
+void statNames(int dirfd, const std::vector<const char *> &names, int flags, std::vector<struct stat> &results, std::vector<int> &errors)
+{
+	static thread_local std::unique_ptr<Uring> uring = gPrefetchBytes ? Uring::create(64) : nullptr;
+	static thread_local bool statxWorks = true;
+	results.resize(names.size());
+	errors.assign(names.size(), 0);
+	std::vector<size_t> serial;
+	if(uring && statxWorks && names.size() > 1)
+	{
+		Profile::Timer timer(Profile::StatFile);
+		std::vector<struct statx> buffers(std::min<size_t>(names.size(), uring->capacity()));
+		for(size_t begin = 0; begin < names.size(); begin += buffers.size())
+		{
+			size_t count = std::min(buffers.size(), names.size() - begin);
+			for(size_t i = 0; i < count; i++)
+			{
+				struct io_uring_sqe *sqe = uring->prepare();
+				sqe->opcode = IORING_OP_STATX;
+				sqe->fd = dirfd;
+				sqe->addr = (uintptr_t)names[begin + i];
+				sqe->len = STATX_BASIC_STATS;
+				sqe->off = (uintptr_t)&buffers[i];
+				sqe->statx_flags = flags|AT_STATX_SYNC_AS_STAT;
+				sqe->user_data = begin + i;
+			}
+			size_t done = 0;
+			while(done < count)
+			{
+				uring->enter(1);
+				uring->reap([&](uint64_t index, int result)
+				{
+					done++;
+					if(result == 0)
+					{
+						statxToStat(buffers[index - begin], results[index]);
+					}
+					else if(result == -EINVAL)
+					{
+						// Most likely a kernel without IORING_OP_STATX,
+						// so let fstatat() say
+						serial.push_back(index);
+					}
+					else
+					{
+						errors[index] = -result;
+					}
+				});
+			}
+		}
+		statxWorks = serial.size() < names.size();
+	}
+	else
+	{
+		for(size_t i = 0; i < names.size(); i++)
+		{
+			serial.push_back(i);
+		}
+	}
+	for(size_t index : serial)
+	{
+		if(0 != statAt(dirfd, names[index], &results[index], flags))
+		{
+			errors[index] = errno;
+		}
+	}
+}
+
+// Open a subdirectory relative to its parent, refusing to follow symlinks
+int openDirectory(int dirfd, const char *name)
+{
+	return openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+}
+
+// Limits on the traversal, set by --max-depth and --max-open-dirs
+int gMaxDepth = -1;		// Levels below the search path to scan, or -1 for no limit
+int gMaxOpenDirs = 256;		// Descriptors kept open for directories still to be descended into
+
+// Directory descriptors currently kept open under gMaxOpenDirs
+std::atomic<int> gOpenDirs{0};
+
+// Keep a directory's descriptor open so that its subdirectories can be opened
+// relative to it, if we are under gMaxOpenDirs.  Otherwise it is closed and
+// -1 returned, and the directory is found by its full path from then on.
+int holdDirectory(int fd)
+{
+	if(++gOpenDirs <= gMaxOpenDirs)
+	{
+		return fd;
+	}
+	gOpenDirs--;
+	close(fd);
+	return -1;
+}
+
+// Close a descriptor returned by holdDirectory(), if it is one
+void releaseDirectory(int fd)
+{
+	if(fd != -1)
+	{
+		close(fd);
+		gOpenDirs--;
+	}
+}
+
+// Whether a directory is on a kernel pseudo-filesystem such as /proc or
+// /sys, which never holds caches and can be huge or even endless to walk
+bool isPseudoFilesystem(int fd)
+{
+	struct statfs info;
+	if(0 != fstatfs(fd, &info))
+	{
+		return false;
+	}
+	switch(info.f_type)
+	{
+	case PROC_SUPER_MAGIC:
+	case SYSFS_MAGIC:
+	case DEVPTS_SUPER_MAGIC:
+	case CGROUP_SUPER_MAGIC:
+	case CGROUP2_SUPER_MAGIC:
+	case DEBUGFS_MAGIC:
+	case TRACEFS_MAGIC:
+	case SECURITYFS_MAGIC:
+	case SELINUX_MAGIC:
+	case SMACK_MAGIC:
+	case BPF_FS_MAGIC:
+	case PSTOREFS_MAGIC:
+	case EFIVARFS_MAGIC:
+	case BINFMTFS_MAGIC:
+	case HUGETLBFS_MAGIC:
+	case NSFS_MAGIC:
+		return true;
+	}
+	return false;
+}
+
+// The disk a filesystem is on, named by its directory under /sys/devices, so
+// that search paths on partitions of one disk, or on volumes built on one
+// partition, are known to share it.  A filesystem without a disk under it,
+// such as tmpfs or NFS, is counted as a disk of its own.
+std::string diskOf(dev_t dev)
+{
+	if(major(dev) == 0)
+	{
+		// btrfs and a few others give out device numbers of their own,
+		// so go by the device the filesystem was mounted from
+		FILE *mounts = fopen("/proc/self/mountinfo", "r");
+		if(mounts)
+		{
+			char *line = nullptr;
+			size_t lineSize = 0;
+			while(getline(&line, &lineSize, mounts) != -1)
+			{
+				unsigned mountMajor, mountMinor;
+				char source[PATH_MAX];
+				const char *fields = strstr(line, " - ");
+				struct stat statbuf;
+				if(2 == sscanf(line, "%*d %*d %u:%u", &mountMajor, &mountMinor) &&
+				   makedev(mountMajor, mountMinor) == dev && fields &&
+				   1 == sscanf(fields, " - %*s %4095s", source) &&
+				   0 == stat(source, &statbuf) && S_ISBLK(statbuf.st_mode))
+				{
+					dev = statbuf.st_rdev;
+					break;
+				}
+			}
+			free(line);
+			fclose(mounts);
+		}
+	}
+
+	char link[64];
+	snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	char resolved[PATH_MAX];
+	if(major(dev) == 0 || !realpath(link, resolved))
+	{
+		return link;
+	}
+	std::string disk = resolved;
+	while(true)
+	{
+		if(0 == access((disk + "/partition").c_str(), F_OK))
+		{
+			disk.erase(disk.rfind('/'));
+			continue;
+		}
+		// A device-mapper or md device over a single device, as with LVM
+		// on one partition, is on whatever that device is on
+		std::string slave;
+		int slaves = 0;
+		if(DIR *dir = opendir((disk + "/slaves").c_str()))
+		{
+			while(struct dirent *entry = readdir(dir))
+			{
+				if(entry->d_name[0] != '.')
+				{
+					slave = entry->d_name;
+					slaves++;
+				}
+			}
+			closedir(dir);
+		}
+		if(slaves != 1 || !realpath((disk + "/slaves/" + slave).c_str(), resolved))
+		{
+			break;
+		}
+		disk = resolved;
+	}
+	return disk;
+}
+
+// The --state-file index of the previous scan, and the one being built for
+// the next.  For every directory it keeps the inode and mtime, the kind, the
+// number its files were archived under, and what its listing turned up: the
+// entries that might be subdirectories, and the files archived with their
+// inode, size and mtime.  A directory whose inode and mtime are unchanged
+// can't have gained or lost entries, so it is replayed from the index
+// instead of being read.  Its subdirectories are still visited, since a
+// change deep in a tree doesn't touch the mtimes above it.
+//
+// The file is used in place through mmap(): a header, the directory records
+// sorted by path hash for binary search, the entry records, and finally the
+// strings they point into.  Everything is in native byte order, so an index
+// is only good on the kind of machine that wrote it.
+class ScanState
+{
+public:
+	struct Header
+	{
+		char magic[8];
+		uint64_t dirCount;
+		uint64_t entryCount;
+		uint64_t stringBytes;
+		uint64_t lastDirNumber;
+		uint64_t settingsHash;	// Of the settings passed to load()
+	};
+
+	struct Dir
+	{
+		uint64_t pathHash;
+		uint64_t path;		// Offset into the strings
+		uint64_t pathLength;
+		uint64_t ino;
+		int64_t mtime;
+		int64_t mtimeNsec;
+		uint64_t firstEntry;	// Subdirectories, then files sorted by name
+		uint32_t subdirCount;
+		uint32_t fileCount;
+		uint32_t dirNumber;	// 0 if nothing was ever archived from it
+		uint32_t kind;
+	};
+
+	struct Entry
+	{
+		uint64_t name;
+		uint64_t nameLength;
+		uint64_t ino;		// ino, size and mtime are only kept for files
+		int64_t size;
+		int64_t mtime;
+		int64_t mtimeNsec;
+		uint32_t type;
+		uint32_t padding;
+	};
+
+	ScanState() = default;
+	ScanState(const ScanState&) = delete;
+	~ScanState();
+
+	// Map the previous index.  A missing file is an empty index; one that is
+	// damaged is warned about and ignored, so the scan starts afresh.  So
+	// is one written with different "settings": the search paths and
+	// whatever else decides which directories are scanned, and as what.
+	void load(const std::string &filename, const std::string &settings);
+
+	// A directory's record in the previous index, or nullptr
+	const Dir *find(const std::string &path) const;
+
+	// Whether a previous record still describes a directory's entries
+	static bool unchanged(const Dir *dir, const struct stat &statbuf);
+
+	// Rebuild an unchanged directory's listing from its record: its
+	// possible subdirectories, and its files stat()ed again through "fd"
+	void replay(const Dir &dir, int fd, DirKind kind, DirListing &subdirs, std::vector<FoundFile> &files) const;
+
+	// Whether a file is new or changed since "dir" was recorded
+	bool fileChanged(const Dir *dir, const FoundFile &file) const;
+
+	// Add a directory to the new index.  Safe to call from any thread.
+	void record(const std::string &path, const struct stat &statbuf, DirKind kind, const std::vector<DirEntry> &subdirs, const std::vector<FoundFile> &files);
+
+	// The number to archive a directory's files under: the one it had in the
+	// previous index, so that a --delta archive extracts over the full one,
+	// or else a new one.  Safe to call from any thread.
+	int directoryNumber(const std::string &path);
+
+	// Keep the number a directory had on the run being resumed.  Safe to
+	// call from any thread.
+	void keepNumber(const std::string &path, int number);
+
+	// Write the new index next to "filename" and rename it into place
+	void save(const std::string &filename);
+
+private:
+	// A subdirectory entry with its own copy of the name, since the
+	// listing it came from will be reused
+	struct Subdir
+	{
+		std::string name;
+		unsigned char type;
+	};
+
+	struct Record
+	{
+		std::string path;
+		struct stat statbuf;
+		DirKind kind;
+		std::vector<Subdir> subdirs;
+		std::vector<FoundFile> files;
+	};
+
+	static uint64_t hash(const std::string &path);
+	std::string_view text(uint64_t offset, uint64_t length) const;
+
+	void *map = nullptr;
+	size_t mapLength = 0;
+	const Header *header = nullptr;
+	const Dir *dirs = nullptr;
+	const Entry *entries = nullptr;
+	const char *strings = nullptr;
+
+	std::mutex lock;
+	std::vector<Record> records;
+	std::unordered_map<std::string, int> numbers;
+
+	uint64_t settingsHash = 0;
+
+	static constexpr char magic[8] = {'R', 'S', 'C', 'F', 'S', 'T', '0', '2'};
+};
+
+// The index for --state-file, if one was given, and whether to archive only
+// what has changed since it was written
+ScanState *gState = nullptr;
+int gDelta = 0;
+
+// Whether to only scan, for --dry-run
+int gDryRun = 0;
+
+ScanState::~ScanState()
+{
+	if(map)
+	{
+		munmap(map, mapLength);
+	}
+}
+
+void ScanState::load(const std::string &filename, const std::string &settings)
+{
+	settingsHash = hash(settings);
+	int fd = open(filename.c_str(), O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+	{
+		if(errno != ENOENT)
+		{
+			fprintf(stderr, "Warning: can't open state file %s: %s, scanning everything\n", filename.c_str(), strerror(errno));
+		}
+		return;
+	}
+	struct stat statbuf;
+	if(0 == fstat(fd, &statbuf) && (size_t)statbuf.st_size >= sizeof(Header))
+	{
+		mapLength = statbuf.st_size;
+		map = mmap(nullptr, mapLength, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map == MAP_FAILED)
+		{
+			map = nullptr;
+		}
+	}
+	close(fd);
+
+	const Header *candidate = (const Header *)map;
+	uint64_t available = mapLength - sizeof(Header);
+	bool valid = map && 0 == memcmp(candidate->magic, magic, sizeof(magic))
+		&& candidate->dirCount <= available / sizeof(Dir)
+		&& candidate->entryCount <= (available - candidate->dirCount * sizeof(Dir)) / sizeof(Entry)
+		&& candidate->stringBytes == available - candidate->dirCount * sizeof(Dir) - candidate->entryCount * sizeof(Entry)
+		&& candidate->lastDirNumber <= INT_MAX;
+	if(!valid)
+	{
+		fprintf(stderr, "Warning: state file %s is damaged, scanning everything\n", filename.c_str());
+		if(map)
+		{
+			munmap(map, mapLength);
+			map = nullptr;
+		}
+		return;
+	}
+	if(candidate->settingsHash != settingsHash)
+	{
+		fprintf(stderr, "Warning: state file %s was written with different search paths, --prune, --exclude, --max-depth or --one-file-system, scanning everything\n", filename.c_str());
+		munmap(map, mapLength);
+		map = nullptr;
+		return;
+	}
+	header = candidate;
+	dirs = (const Dir *)(header + 1);
+	entries = (const Entry *)(dirs + header->dirCount);
+	strings = (const char *)(entries + header->entryCount);
+	gDirCounter = header->lastDirNumber;
+}
+
+uint64_t ScanState::hash(const std::string &path)
+{
+	// FNV-1a
+	uint64_t value = 14695981039346656037ULL;
+	for(unsigned char c : path)
+	{
+		value = (value ^ c) * 1099511628211ULL;
+	}
+	return value;
+}
+
+// Strings are checked against the mapping, so a damaged index can only ever
+// produce wrong answers rather than wild reads
+std::string_view ScanState::text(uint64_t offset, uint64_t length) const
+{
+	if(offset > header->stringBytes || length > header->stringBytes - offset)
+	{
+		return std::string_view();
+	}
+	return std::string_view(strings + offset, length);
+}
+
+const ScanState::Dir *ScanState::find(const std::string &path) const
+{
+	if(!header)
+	{
+		return nullptr;
+	}
+	uint64_t key = hash(path);
+	const Dir *end = dirs + header->dirCount;
+	const Dir *dir = std::lower_bound(dirs, end, key, [](const Dir &dir, uint64_t key)
+	{
+		return dir.pathHash < key;
+	});
+	for(; dir != end && dir->pathHash == key; dir++)
+	{
+		uint64_t count = (uint64_t)dir->subdirCount + dir->fileCount;
+		if(text(dir->path, dir->pathLength) == path && dir->firstEntry <= header->entryCount && count <= header->entryCount - dir->firstEntry)
+		{
+			return dir;
+		}
+	}
+	return nullptr;
+}
+
+bool ScanState::unchanged(const Dir *dir, const struct stat &statbuf)
+{
+	return dir && dir->ino == statbuf.st_ino && dir->mtime == statbuf.st_mtim.tv_sec && dir->mtimeNsec == statbuf.st_mtim.tv_nsec;
+}
+
+void ScanState::replay(const Dir &dir, int fd, DirKind kind, DirListing &subdirs, std::vector<FoundFile> &files) const
+{
+	subdirs.clear();
+	const Entry *entry = entries + dir.firstEntry;
+	for(uint32_t i = 0; i < dir.subdirCount; i++, entry++)
+	{
+		subdirs.add(text(entry->name, entry->nameLength), entry->type);
+	}
+	std::vector<std::string> names;
+	std::vector<const char *> pointers;
+	for(uint32_t i = 0; i < dir.fileCount; i++, entry++)
+	{
+		names.emplace_back(text(entry->name, entry->nameLength));
+	}
+	for(auto &name : names)
+	{
+		pointers.push_back(name.c_str());
+	}
+	// Cache directories take symlinks to files, as in findCacheDirFiles()
+	std::vector<struct stat> results;
+	std::vector<int> errors;
+	statNames(fd, pointers, (kind == CacheDir) ? 0 : AT_SYMLINK_NOFOLLOW, results, errors);
+	for(size_t i = 0; i < names.size(); i++)
+	{
+		if(errors[i])
+		{
+			std::filesystem::path path = std::filesystem::path(text(dir.path, dir.pathLength)) / names[i];
+			fprintf(stderr, "Stat error %s for file %s when adding to archive\n", strerror(errors[i]), path.c_str());
+			Stats::add(Stats::Errors);
+			continue;
+		}
+		if(S_ISREG(results[i].st_mode))
+		{
+			files.push_back({std::move(names[i]), results[i]});
+		}
+	}
+}
+
+bool ScanState::fileChanged(const Dir *dir, const FoundFile &file) const
+{
+	if(!dir)
+	{
+		return true;
+	}
+	const Entry *begin = entries + dir->firstEntry + dir->subdirCount;
+	const Entry *end = begin + dir->fileCount;
+	const Entry *entry = std::lower_bound(begin, end, file.name, [this](const Entry &entry, const std::string &name)
+	{
+		return text(entry.name, entry.nameLength) < name;
+	});
+	return entry == end || text(entry->name, entry->nameLength) != file.name
+		|| entry->ino != file.statbuf.st_ino || entry->size != file.statbuf.st_size
+		|| entry->mtime != file.statbuf.st_mtim.tv_sec || entry->mtimeNsec != file.statbuf.st_mtim.tv_nsec;
+}
+
+void ScanState::record(const std::string &path, const struct stat &statbuf, DirKind kind, const std::vector<DirEntry> &subdirs, const std::vector<FoundFile> &files)
+{
+	Record record{path, statbuf, kind, {}, files};
+	for(auto &subdir : subdirs)
+	{
+		record.subdirs.push_back({std::string(subdir.name), subdir.type});
+	}
+	std::sort(record.files.begin(), record.files.end(), [](const FoundFile &a, const FoundFile &b)
+	{
+		return a.name < b.name;
+	});
+	std::lock_guard<std::mutex> guard(lock);
+	records.push_back(std::move(record));
+}
+
+int ScanState::directoryNumber(const std::string &path)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto found = numbers.find(path);
+	if(found != numbers.end())
+	{
+		return found->second;
+	}
+	const Dir *previous = find(path);
+	int number = (previous && previous->dirNumber) ? previous->dirNumber : ++gDirCounter;
+	numbers.emplace(path, number);
+	return number;
+}
+
+void ScanState::keepNumber(const std::string &path, int number)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	numbers[path] = number;
+}
+
+void ScanState::save(const std::string &filename)
+{
+	std::sort(records.begin(), records.end(), [](const Record &a, const Record &b)
+	{
+		uint64_t hashA = hash(a.path), hashB = hash(b.path);
+		return (hashA != hashB) ? hashA < hashB : a.path < b.path;
+	});
+
+	std::vector<Dir> newDirs;
+	std::vector<Entry> newEntries;
+	std::string newStrings;
+	auto addString = [&](const std::string &value)
+	{
+		uint64_t offset = newStrings.size();
+		newStrings += value;
+		return offset;
+	};
+	for(auto &record : records)
+	{
+		Dir dir{};
+		dir.pathHash = hash(record.path);
+		dir.path = addString(record.path);
+		dir.pathLength = record.path.length();
+		dir.ino = record.statbuf.st_ino;
+		dir.mtime = record.statbuf.st_mtim.tv_sec;
+		dir.mtimeNsec = record.statbuf.st_mtim.tv_nsec;
+		dir.firstEntry = newEntries.size();
+		dir.subdirCount = record.subdirs.size();
+		dir.fileCount = record.files.size();
+		dir.kind = record.kind;
+		auto number = numbers.find(record.path);
+		const Dir *previous = find(record.path);
+		dir.dirNumber = (number != numbers.end()) ? number->second : previous ? previous->dirNumber : 0;
+		newDirs.push_back(dir);
+
+		for(auto &subdir : record.subdirs)
+		{
+			Entry entry{};
+			entry.name = addString(subdir.name);
+			entry.nameLength = subdir.name.length();
+			entry.type = subdir.type;
+			newEntries.push_back(entry);
+		}
+		for(auto &file : record.files)
+		{
+			Entry entry{};
+			entry.name = addString(file.name);
+			entry.nameLength = file.name.length();
+			entry.ino = file.statbuf.st_ino;
+			entry.size = file.statbuf.st_size;
+			entry.mtime = file.statbuf.st_mtim.tv_sec;
+			entry.mtimeNsec = file.statbuf.st_mtim.tv_nsec;
+			entry.type = DT_REG;
+			newEntries.push_back(entry);
+		}
+	}
+
+	Header newHeader{};
+	memcpy(newHeader.magic, magic, sizeof(magic));
+	newHeader.dirCount = newDirs.size();
+	newHeader.entryCount = newEntries.size();
+	newHeader.stringBytes = newStrings.size();
+	newHeader.lastDirNumber = gDirCounter;
+	newHeader.settingsHash = settingsHash;
+
+	std::string temporary = filename + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "wb");
+	if(!file)
+	{
+		fprintf(stderr, "Error %s creating state file %s\n", strerror(errno), temporary.c_str());
+		throw std::runtime_error("Failed to save state");
+	}
+	bool written = 1 == fwrite(&newHeader, sizeof(newHeader), 1, file)
+		&& newDirs.size() == fwrite(newDirs.data(), sizeof(Dir), newDirs.size(), file)
+		&& newEntries.size() == fwrite(newEntries.data(), sizeof(Entry), newEntries.size(), file)
+		&& newStrings.size() == fwrite(newStrings.data(), 1, newStrings.size(), file);
+	written = (0 == fflush(file)) && written && (0 == fsync(fileno(file)));
+	if(0 != fclose(file) || !written || 0 != rename(temporary.c_str(), filename.c_str()))
+	{
+		fprintf(stderr, "Error %s writing state file %s\n", strerror(errno), filename.c_str());
+		unlink(temporary.c_str());
+		throw std::runtime_error("Failed to save state");
+	}
+}
+
+Checkpoint::Checkpoint(const std::string &output, int interval, bool resume, Compressor::Format compression, bool manifest) : filename(output + ".checkpoint"), interval(interval)
+{
+	fd = open(filename.c_str(), resume ? O_RDWR|O_APPEND|O_CLOEXEC : O_WRONLY|O_APPEND|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+	if(fd == -1)
+	{
+		fprintf(stderr, "Error %s opening checkpoint %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to open checkpoint");
+	}
+	if(resume)
+	{
+		load(compression, manifest);
+		nextCommit = std::chrono::steady_clock::now() + this->interval;
+		return;
+	}
+	std::string begin(magic, sizeof(magic));
+	uint32_t settings[2] = {compression, manifest};
+	put(begin, settings, sizeof(settings));
+	pending = record(Begin, begin);
+	commit(0, manifest ? 0 : -1);
+}
+
+Checkpoint::~Checkpoint()
+{
+	if(fd != -1)
+	{
+		close(fd);
+	}
+}
+
+void Checkpoint::put(std::string &out, const void *data, size_t length)
+{
+	out.append((const char *)data, length);
+}
+
+void Checkpoint::putString(std::string &out, std::string_view value)
+{
+	uint32_t length = value.length();
+	put(out, &length, sizeof(length));
+	out += value;
+}
+
+// A record is its type and the length of what follows
+std::string Checkpoint::record(RecordType type, const std::string &payload)
+{
+	uint32_t head[2] = {type, (uint32_t)payload.length()};
+	std::string out;
+	put(out, head, sizeof(head));
+	out += payload;
+	return out;
+}
+
+void Checkpoint::load(Compressor::Format compression, bool manifest)
+{
+	std::string data;
+	char buffer[65536];
+	ssize_t result;
+	while((result = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		data.append(buffer, result);
+	}
+	if(result < 0)
+	{
+		fprintf(stderr, "Error %s reading checkpoint %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to read checkpoint");
+	}
+
+	// Anything after the last commit was never synced, and may have been
+	// cut short by whatever stopped the run
+	struct Record
+	{
+		RecordType type;
+		std::string_view payload;
+	};
+	std::vector<Record> records;
+	size_t committed = 0, committedRecords = 0;
+	for(size_t pos = 0; data.length() - pos >= 2 * sizeof(uint32_t); )
+	{
+		uint32_t head[2];
+		memcpy(head, data.data() + pos, sizeof(head));
+		pos += sizeof(head);
+		if(head[0] > Commit || head[1] > data.length() - pos)
+		{
+			break;
+		}
+		records.push_back({(RecordType)head[0], std::string_view(data.data() + pos, head[1])});
+		pos += head[1];
+		if(head[0] == Commit)
+		{
+			committed = pos;
+			committedRecords = records.size();
+		}
+	}
+	records.resize(committedRecords);
+
+	const char *next, *end;
+	auto get = [&](void *value, size_t length)
+	{
+		if((size_t)(end - next) < length)
+		{
+			return false;
+		}
+		memcpy(value, next, length);
+		next += length;
+		return true;
+	};
+	auto getString = [&](std::string &value)
+	{
+		uint32_t length;
+		if(!get(&length, sizeof(length)) || (size_t)(end - next) < length)
+		{
+			return false;
+		}
+		value.assign(next, length);
+		next += length;
+		return true;
+	};
+	bool valid = !records.empty() && records[0].type == Begin;
+	for(size_t i = 0; valid && i < records.size(); i++)
+	{
+		next = records[i].payload.data();
+		end = next + records[i].payload.length();
+		std::string path;
+		switch(records[i].type)
+		{
+		case Begin:
+		{
+			char found[sizeof(magic)];
+			uint32_t settings[2];
+			valid = i == 0 && get(found, sizeof(found)) && 0 == memcmp(found, magic, sizeof(magic)) && get(settings, sizeof(settings));
+			if(valid && (settings[0] != (uint32_t)compression || settings[1] != (uint32_t)manifest))
+			{
+				fprintf(stderr, "Error: %s was started with a different --compress or --manifest\n", filename.c_str());
+				throw std::runtime_error("Failed to resume");
+			}
+			break;
+		}
+		case Started:
+		{
+			uint32_t number;
+			valid = get(&number, sizeof(number)) && getString(path) && number > 0 && number <= INT_MAX;
+			if(valid)
+			{
+				numbers[path] = number;
+			}
+			break;
+		}
+		case Added:
+			valid = getString(path);
+			if(valid)
+			{
+				archivedFiles.insert(std::move(path));
+			}
+			break;
+		case Finished:
+		{
+			Dir dir;
+			uint32_t kind, count;
+			valid = getString(path) && get(&dir.statbuf, sizeof(dir.statbuf)) && get(&kind, sizeof(kind)) && kind <= CacheDir && get(&count, sizeof(count));
+			for(uint32_t j = 0; valid && j < count; j++)
+			{
+				Subdir subdir;
+				valid = getString(subdir.name) && get(&subdir.type, sizeof(subdir.type));
+				dir.subdirs.push_back(std::move(subdir));
+			}
+			valid = valid && get(&count, sizeof(count));
+			for(uint32_t j = 0; valid && j < count; j++)
+			{
+				FoundFile file;
+				valid = getString(file.name) && get(&file.statbuf, sizeof(file.statbuf));
+				dir.files.push_back(std::move(file));
+			}
+			if(valid)
+			{
+				dir.kind = (DirKind)kind;
+				finishedDirs[path] = std::move(dir);
+			}
+			break;
+		}
+		case Commit:
+		{
+			int64_t lengths[2];
+			uint64_t counter;
+			valid = get(lengths, sizeof(lengths)) && get(&counter, sizeof(counter)) && lengths[0] >= 0 && counter <= INT_MAX;
+			if(valid)
+			{
+				lastArchiveLength = lengths[0];
+				lastManifestLength = lengths[1];
+				gDirCounter = counter;
+			}
+			break;
+		}
+		}
+	}
+	if(!valid)
+	{
+		fprintf(stderr, "Error: checkpoint %s is damaged\n", filename.c_str());
+		throw std::runtime_error("Failed to resume");
+	}
+
+	// Only the files of directories left part way through are needed
+	for(auto file = archivedFiles.begin(); file != archivedFiles.end(); )
+	{
+		if(finishedDirs.count(std::filesystem::path(*file).parent_path().native()))
+		{
+			file = archivedFiles.erase(file);
+		}
+		else
+		{
+			++file;
+		}
+	}
+
+	if(0 != ftruncate(fd, committed))
+	{
+		fprintf(stderr, "Error %s cutting back checkpoint %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to resume");
+	}
+}
+
+const Checkpoint::Dir *Checkpoint::finished(const std::string &path) const
+{
+	auto found = finishedDirs.find(path);
+	return (found == finishedDirs.end()) ? nullptr : &found->second;
+}
+
+int Checkpoint::number(const std::string &path) const
+{
+	auto found = numbers.find(path);
+	return (found == numbers.end()) ? 0 : found->second;
+}
+
+bool Checkpoint::archived(const std::string &path) const
+{
+	return archivedFiles.count(path) != 0;
+}
+
+void Checkpoint::started(const std::string &path, int number)
+{
+	std::string payload;
+	uint32_t value = number;
+	put(payload, &value, sizeof(value));
+	putString(payload, path);
+	append(record(Started, payload));
+}
+
+void Checkpoint::fileAdded(const std::string &path)
+{
+	std::string payload;
+	putString(payload, path);
+	append(record(Added, payload));
+}
+
+std::string Checkpoint::describe(const std::string &path, const struct stat &statbuf, DirKind kind, const std::vector<DirEntry> &subdirs, const std::vector<FoundFile> &files)
+{
+	std::string payload;
+	putString(payload, path);
+	put(payload, &statbuf, sizeof(statbuf));
+	uint32_t value = kind;
+	put(payload, &value, sizeof(value));
+	value = subdirs.size();
+	put(payload, &value, sizeof(value));
+	for(auto &subdir : subdirs)
+	{
+		putString(payload, subdir.name);
+		put(payload, &subdir.type, sizeof(subdir.type));
+	}
+	// The files are only needed to rebuild the state file's record
+	value = gState ? files.size() : 0;
+	put(payload, &value, sizeof(value));
+	for(uint32_t i = 0; i < value; i++)
+	{
+		putString(payload, files[i].name);
+		put(payload, &files[i].statbuf, sizeof(files[i].statbuf));
+	}
+	return record(Finished, payload);
+}
+
+void Checkpoint::append(const std::string &record)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	pending += record;
+}
+
+void Checkpoint::commit(off_t archiveLength, off_t manifestLength)
+{
+	std::string data;
+	{
+		// gDirCounter is read under the lock, so that every number
+		// journaled before the commit is covered by it
+		std::lock_guard<std::mutex> guard(lock);
+		std::string payload;
+		int64_t lengths[2] = {archiveLength, manifestLength};
+		uint64_t counter = gDirCounter;
+		put(payload, lengths, sizeof(lengths));
+		put(payload, &counter, sizeof(counter));
+		pending += record(Commit, payload);
+		data.swap(pending);
+	}
+	Profile::Timer timer(Profile::Flush);
+	for(size_t written = 0; written < data.length(); )
+	{
+		ssize_t result = write(fd, data.data() + written, data.length() - written);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result <= 0)
+		{
+			fprintf(stderr, "Error %s writing checkpoint %s\n", strerror(errno), filename.c_str());
+			throw std::runtime_error("Failed to write checkpoint");
+		}
+		written += result;
+	}
+	if(0 != fdatasync(fd))
+	{
+		fprintf(stderr, "Error %s writing checkpoint %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to write checkpoint");
+	}
+	nextCommit = std::chrono::steady_clock::now() + interval;
+}
+
+void Checkpoint::remove()
+{
+	close(fd);
+	fd = -1;
+	if(0 != unlink(filename.c_str()))
+	{
+		fprintf(stderr, "Warning: can't delete checkpoint %s: %s\n", filename.c_str(), strerror(errno));
+	}
+}
+
+int directoryNumber(const std::filesystem::path &dir)
+{
+	// A directory part way through at the checkpoint being resumed from
+	// carries on under the number it had
+	int number = gCheckpoint ? gCheckpoint->number(dir.native()) : 0;
+	if(number)
+	{
+		if(gState)
+		{
+			gState->keepNumber(dir.native(), number);
+		}
+		return number;
+	}
+	number = gState ? gState->directoryNumber(dir.native()) : ++gDirCounter;
+	if(gCheckpoint)
+	{
+		gCheckpoint->started(dir.native(), number);
+	}
+	return number;
+}
+
+// Find the files to archive from a cache directory, without recursing.  I
+// don't know if the non-recursion is important or not, but it's how the
+// Windows finder works.
+void findCacheDirFiles(const std::filesystem::path &source, int fd, const std::vector<DirEntry> &entries, std::vector<FoundFile> &files)
+{
+	std::vector<const DirEntry *> candidates;
+	std::vector<const char *> names;
+	for(auto &entry : entries)
+	{
+		if(entry.type == DT_REG || entry.type == DT_LNK || entry.type == DT_UNKNOWN)
+		{
+			candidates.push_back(&entry);
+			names.push_back(entry.name.data());
+		}
+	}
+	// Symlinks to files are followed here, unlike in findCacheFiles()
+	static thread_local std::vector<struct stat> results;
+	static thread_local std::vector<int> errors;
+	statNames(fd, names, 0, results, errors);
+	for(size_t i = 0; i < candidates.size(); i++)
+	{
+		const DirEntry &entry = *candidates[i];
+		if(errors[i])
+		{
+			if(entry.type == DT_REG)
+			{
+				fprintf(stderr, "Stat error %s for file %s when adding to archive\n", strerror(errors[i]), (source / entry.name).c_str());
+				Stats::add(Stats::Errors);
+			}
+			continue;
+		}
+		if(S_ISREG(results[i].st_mode))
+		{
+			files.push_back({std::string(entry.name), results[i]});
+		}
+	}
+}
+
+// Look through a directory's entries for cache-named files
+void findCacheFiles(const std::filesystem::path &source, int fd, const std::vector<DirEntry> &entries, std::vector<FoundFile> &files)
+{
+	// Only stat the files that match
+	std::vector<const DirEntry *> matches;
+	std::vector<const char *> names;
+	for(auto &entry : entries)
+	{
+		if(entryType(fd, entry.name.data(), entry.type) == DT_REG && searchRegexes(entry.name, cacheRegexes))
+		{
+			matches.push_back(&entry);
+			names.push_back(entry.name.data());
+		}
+	}
+	if(matches.empty())
+	{
+		return;
+	}
+	static thread_local std::vector<struct stat> results;
+	static thread_local std::vector<int> errors;
+	statNames(fd, names, AT_SYMLINK_NOFOLLOW, results, errors);
+	for(size_t i = 0; i < matches.size(); i++)
+	{
+		if(errors[i])
+		{
+			fprintf(stderr, "Stat error %s for file %s when adding to archive\n", strerror(errors[i]), (source / matches[i]->name).c_str());
+			Stats::add(Stats::Errors);
+			continue;
+		}
+		files.push_back({std::string(matches[i]->name), results[i]});
+	}
+}
+
+// Asks the kernel to start reading a directory's files before the archive
+// writer gets to them, for --prefetch, with no more than gPrefetchBytes of
+// them between the writer and the last file asked for.  Files bigger than
+// that are left to the read-ahead of the mapping they are read through.
+class FilePrefetcher
+{
+public:
+	FilePrefetcher(int fd, const std::vector<FoundFile> &files, const ScanState::Dir *previous, ArchiveWriter &archive) : fd(fd), files(files), previous(previous), archive(archive) {}
+
+	// Called as files[index] is about to be added
+	void adding(size_t index);
+
+private:
+	bool wanted(const FoundFile &file) const
+	{
+		return file.statbuf.st_size <= (off_t)gPrefetchBytes && (!gDelta || gState->fileChanged(previous, file));
+	}
+
+	int fd;
+	const std::vector<FoundFile> &files;
+	const ScanState::Dir *previous;
+	ArchiveWriter &archive;
+	size_t next = 0;	// The first file not yet considered
+	uint64_t ahead = 0;	// Bytes asked for and not yet added
+};
+
+void FilePrefetcher::adding(size_t index)
+{
+	if(!gPrefetchBytes || fd == -1)
+	{
+		return;
+	}
+	if(index >= next)
+	{
+		// Too late to ask for this one
+		next = index + 1;
+	}
+	else if(wanted(files[index]))
+	{
+		ahead -= files[index].statbuf.st_size;
+	}
+	uint64_t room = archive.room(gPrefetchBytes);
+	while(next < files.size() && ahead + files[next].statbuf.st_size <= room)
+	{
+		const FoundFile &file = files[next++];
+		if(!wanted(file))
+		{
+			continue;
+		}
+		Profile::Timer timer(Profile::Prefetch);
+		int fileFd = openat(fd, file.name.c_str(), O_RDONLY|O_CLOEXEC);
+		if(fileFd != -1)
+		{
+			posix_fadvise(fileFd, 0, file.statbuf.st_size, POSIX_FADV_WILLNEED);
+			close(fileFd);
+		}
+		ahead += file.statbuf.st_size;
+	}
+}
+
+// Add the files found in a directory, open as "fd", to the tarball.  With
+// --delta, files that haven't changed since "previous" was recorded are left
+// out.
+void archiveFiles(const std::filesystem::path &source, int fd, DirKind kind, const ScanState::Dir *previous, const std::vector<FoundFile> &files, ArchiveWriter &archive, int verbose)
+{
+	bool started = false;
+	const std::string *prefix = nullptr;
+	if(kind == CacheDir)
+	{
+		started = true;
+		prefix = &archive.startDirectory(source);
+	}
+	FilePrefetcher prefetcher(fd, files, previous, archive);
+	for(size_t i = 0; i < files.size(); i++)
+	{
+		const FoundFile &file = files[i];
+		std::filesystem::path path = source / file.name;
+		if(kind == PlainDir)
+		{
+			printIfVerbose(verbose, "Cache file match: %s\n", path.c_str());
+		}
+		if(gDelta && !gState->fileChanged(previous, file))
+		{
+			continue;
+		}
+		if(gCheckpoint && gCheckpoint->archived(path.native()))
+		{
+			continue;
+		}
+		prefetcher.adding(i);
+		printf(gDryRun ? "Found file %s\n" : "Adding file %s to archive\n", path.c_str());
+		if(!started)
+		{
+			started = true;
+			prefix = &archive.startDirectory(source);
+		}
+		archive.add(path, file.statbuf, *prefix);
+	}
+	if(started)
+	{
+		archive.endDirectory(*prefix);
+	}
+}
 
-// Directories to include if their parent is in cacheDirParents
-std::vector<std::string> parentedCacheDirs = {
-	"^live$",
-	"^live_beta$",
+// Read a directory, open as "fd", exactly once, or not at all if the state
+// file shows it is unchanged, and archive whatever its kind calls for.
+// Afterwards the listing's entries are only what might be a subdirectory, so
+// a directory waiting to be descended into costs as little as possible.
+bool readDirectory(const std::filesystem::path &source, int fd, DirKind kind, const struct stat &statbuf, DirListing &listing, ArchiveWriter &archive, int verbose)
+{
+	Profile::ItemTimer itemTimer(Profile::Directory, source);
+	// A directory finished with before the checkpoint being resumed from
+	// is only descended through
+	const Checkpoint::Dir *resumed = gCheckpoint ? gCheckpoint->finished(source.native()) : nullptr;
+	if(resumed)
+	{
+		listing.clear();
+		for(auto &subdir : resumed->subdirs)
+		{
+			listing.add(subdir.name, subdir.type);
+		}
+		Stats::add(Stats::Dirs);
+		if(gState)
+		{
+			int number = gCheckpoint->number(source.native());
+			if(number)
+			{
+				gState->keepNumber(source.native(), number);
+			}
+			gState->record(source.native(), resumed->statbuf, resumed->kind, listing.entries, resumed->files);
+		}
+		return true;
+	}
+	const ScanState::Dir *previous = gState ? gState->find(source.native()) : nullptr;
+	std::vector<FoundFile> files;
+	std::vector<DirEntry> &entries = listing.entries;
+	if(ScanState::unchanged(previous, statbuf))
+	{
+		gState->replay(*previous, fd, kind, listing, files);
+	}
+	else
+	{
+		bool listed;
+		{
+			Profile::Timer timer(Profile::Enumerate);
+			listed = listDirectory(fd, listing);
+		}
+		if(!listed)
+		{
+			fprintf(stderr, "Error %s directory %s: %s\n", (kind == CacheDir) ? "processing cache" : "scanning", source.c_str(), strerror(errno));
+			Stats::add(Stats::Errors);
+			return false;
+		}
+		Stats::add(Stats::Entries, entries.size());
+		if(kind == CacheDir)
+		{
+			findCacheDirFiles(source, fd, entries, files);
+		}
+		else if(kind == PlainDir)
+		{
+			findCacheFiles(source, fd, entries, files);
+		}
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [](const DirEntry &entry)
+		{
+			return entry.type != DT_DIR && entry.type != DT_LNK && entry.type != DT_UNKNOWN;
+		}), entries.end());
+	}
+	Stats::add(Stats::Dirs);
+	// With --prefetch, the subdirectories are looked up together now, so
+	// that descending into each of them later doesn't wait on the disk
+	if(gPrefetchBytes && entries.size() > 1)
+	{
+		std::vector<const char *> names;
+		for(auto &entry : entries)
+		{
+			names.push_back(entry.name.data());
+		}
+		static thread_local std::vector<struct stat> results;
+		static thread_local std::vector<int> errors;
+		statNames(fd, names, AT_SYMLINK_NOFOLLOW, results, errors);
+	}
+	// Without --jobs the files are written out from here, which is the
+	// files' time rather than the directory's
+	itemTimer.stop();
+	archiveFiles(source, fd, kind, previous, files, archive, verbose);
+	if(gState)
+	{
+		gState->record(source.native(), statbuf, kind, entries, files);
+	}
+	if(gCheckpoint)
+	{
+		archive.directoryDone(Checkpoint::describe(source.native(), statbuf, kind, entries, files));
+	}
+	printIfVerbose(verbose, "Scanning %s\n", source.c_str());
+	return true;
+}
+
+// A subdirectory found by nextSubdirectory(), open and ready to be read
+struct Subdirectory
+{
+	std::filesystem::path path;
+	int fd;
+	DirKind kind;
+	struct stat statbuf;
 };
 
-std::vector<std::string> cacheDirParents = {
-	"^oldschool$",
-	"^runescape$",
+// Find the next subdirectory of "source" that should be scanned, starting from
+// entries[next].  "fd" is source's descriptor, or -1 if it wasn't kept, in
+// which case entries are looked up by their full path, and "dev" is the
+// device it is on.  Returns false once there are none left.
+bool nextSubdirectory(const std::filesystem::path &source, int fd, dev_t dev, const std::vector<DirEntry> &entries, size_t &next, int verbose, Subdirectory &child)
+{
+	while(next < entries.size())
+	{
+		const DirEntry &entry = entries[next++];
+		// The full path is only built for entries that are scanned or
+		// reported, unless the parent has to be found by path too
+		std::filesystem::path dir;
+		auto fullPath = [&]() -> const std::filesystem::path &
+		{
+			if(dir.empty())
+			{
+				dir = source / entry.name;
+			}
+			return dir;
+		};
+		int at = (fd == -1) ? AT_FDCWD : fd;
+		const char *name = (fd == -1) ? fullPath().c_str() : entry.name.data();
+
+		unsigned char type = entryType(at, name, entry.type);
+		if(type == DT_LNK && verbose)
+		{
+			struct stat statbuf;
+			if(0 == fstatat(at, name, &statbuf, 0) && S_ISDIR(statbuf.st_mode))
+			{
+				printIfVerbose(verbose, "Skipping directory symlink %s\n", fullPath().c_str());
+			}
+			continue;
+		}
+		if(type != DT_DIR)
+		{
+			continue;
+		}
+
+		if(pruneNames.count(entry.name) || (!prunePaths.empty() && prunePaths.count(fullPath().native())) || searchRegexes(entry.name, cacheExcludeRegexes))
+		{
+			printIfVerbose(verbose, "Excluding directory %s\n", fullPath().c_str());
+			continue;
+		}
+		fullPath();	// Everything from here on uses "dir"
+		int dirFd = openDirectory(at, name);
+		struct stat statbuf;
+		if(dirFd == -1 || 0 != fstat(dirFd, &statbuf))
+		{
+			if(errno != EACCES)
+			{
+				fprintf(stderr, "Error processing entry %s: %s\n", dir.c_str(), strerror(errno));
+				Stats::add(Stats::Errors);
+			}
+			if(dirFd != -1)
+			{
+				close(dirFd);
+			}
+			continue;
+		}
+		// Only a mount point can change filesystem, so that's the only
+		// time it's worth asking what the new one is
+		if(statbuf.st_dev != dev && (gOneFileSystem || isPseudoFilesystem(dirFd)))
+		{
+			printIfVerbose(verbose, "Skipping %s %s\n", gOneFileSystem ? "mount point" : "pseudo-filesystem", dir.c_str());
+			close(dirFd);
+			continue;
+		}
+		// A directory in the state file keeps the kind it had, since that
+		// only depends on its path
+		const ScanState::Dir *previous = gState ? gState->find(dir.native()) : nullptr;
+		child.kind = previous ? (DirKind)previous->kind : PlainDir;
+		if(!previous && isCacheDir(entry.name, lastComponent(source.native()), verbose))
+		{
+			child.kind = CacheDir;
+		}
+		if(child.kind == CacheDir)
+		{
+			printIfVerbose(verbose, "Cache dir found: %s\n", dir.c_str());
+		}
+		child.path = std::move(dir);
+		child.fd = dirFd;
+		child.statbuf = statbuf;
+		return true;
+	}
+	return false;
+}
+
+// A directory on scanPath()'s stack, part way through its subdirectories
+struct ScanFrame
+{
+	std::filesystem::path path;
+	int fd;		// From holdDirectory(), so may be -1
+	dev_t dev;
+	int depth;
+	DirListing listing;
+	size_t next;
 };
 
-std::vector<std::regex> parentedCacheDirRegexes;
-std::vector<std::regex> cacheDirParentRegexes;
+// Scan the tree under "source", depth first.  The stack lives on the heap and
+// each frame keeps only its directory's remaining subdirectory entries, so a
+// deep tree costs memory in proportion to its depth rather than call stack,
+// and no more than gMaxOpenDirs descriptors are held at once.  Frames are
+// kept when they are popped, so each level of the tree reuses the same
+// listing for every directory at that depth.
+void scanPath(const std::filesystem::path &source, ArchiveWriter &archive, int verbose)
+{
+	int fd = open(source.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(fd == -1)
+	{
+		fprintf(stderr, "Error scanning directory %s: %s\n", source.c_str(), strerror(errno));
+		Stats::add(Stats::Errors);
+		return;
+	}
+
+	struct stat statbuf;
+	if(0 != fstat(fd, &statbuf))
+	{
+		fprintf(stderr, "Error scanning directory %s: %s\n", source.c_str(), strerror(errno));
+		Stats::add(Stats::Errors);
+		close(fd);
+		return;
+	}
+
+	std::vector<ScanFrame> stack;
+	size_t depthUsed = 0;	// Frames in use; the rest are spare
+	auto enter = [&](Subdirectory &dir, int depth)
+	{
+		if(depthUsed == stack.size())
+		{
+			stack.emplace_back();
+		}
+		ScanFrame &frame = stack[depthUsed];
+		if(!readDirectory(dir.path, dir.fd, dir.kind, dir.statbuf, frame.listing, archive, verbose) || depth == gMaxDepth)
+		{
+			close(dir.fd);
+			return;
+		}
+		frame.path = std::move(dir.path);
+		frame.fd = holdDirectory(dir.fd);
+		frame.dev = dir.statbuf.st_dev;
+		frame.depth = depth;
+		frame.next = 0;
+		depthUsed++;
+	};
+
+	Subdirectory root{source, fd, RootDir, statbuf};
+	enter(root, 0);
+	while(depthUsed > 0)
+	{
+		ScanFrame &frame = stack[depthUsed - 1];
+		Subdirectory child;
+		if(!nextSubdirectory(frame.path, frame.fd, frame.dev, frame.listing.entries, frame.next, verbose, child))
+		{
+			releaseDirectory(frame.fd);
+			depthUsed--;
+			continue;
+		}
+		enter(child, frame.depth + 1);
+	}
+}
+
+// Scan trees with a pool of threads for --jobs.  Each worker owns a deque of
+// directories waiting to be scanned: it pushes and pops at the back of its
+// own deque, and when that runs dry steals from the front of another
+// worker's, so large subtrees are split up between threads as they are
+// discovered.
+//
+// Several search paths are scanned at once.  Every directory belongs to the
+// disk its search path is on, with a deque per disk, and no more than
+// "deviceJobs" workers take directories from one disk at a time, so search
+// paths on partitions of the same spinning disk don't fight over its heads.
+// Workers start looking on different disks, so each gets its share.
+class ParallelScanner
+{
+public:
+	ParallelScanner(int jobs, int deviceJobs, ArchiveWriter &archive, int verbose);
+
+	void scan(const std::vector<std::filesystem::path> &sources);
+
+private:
+	struct Dir
+	{
+		std::filesystem::path path;
+		int fd;		// From holdDirectory(), or -1 to open by path
+		DirKind kind;
+		struct stat statbuf;
+		int depth;
+		size_t disk;
+	};
+
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::vector<std::deque<Dir>> dirs;	// One for each disk
+	};
+
+	void run(size_t self);
+	void push(size_t self, const Dir &dir);
+	bool pop(size_t self, Dir &dir);
+	bool take(size_t self, size_t disk, Dir &dir);
 
-// Directory trees to exclude because they are known to produce false positives
-std::vector<std::string> cacheExcludeDirs = {
-	"^planeshift$",
-};
+	ArchiveWriter &archive;
+	int deviceJobs;
+	int verbose;
+	std::vector<WorkQueue> queues;
 
-std::vector<std::regex> cacheExcludeRegexes;
+	// Workers scanning a directory on each disk
+	std::vector<std::atomic<int>> busy;
 
-std::vector<std::string> cachePatterns = {
-	"^code\\.dat$",
-	"^jingle0\\.mid$",
-	"^jingle1\\.mid$",
-	"^jingle2\\.mid$",
-	"^jingle3\\.mid$",
-	"^jingle4\\.mid$",
-	"^shared_game_unpacker\\.dat$",
-	"^worldmap\\.dat$",
+	// Directories queued or being scanned.  The scan is over once this drops
+	// to zero.
+	std::atomic<size_t> pending{0};
+	std::atomic<bool> failed{false};
 
-	"^1jfds",
-	"^94jfj",
-	"^a2155",
-	"^cht3f",
-	"^g34zx",
-	"^k23lk",
-	"^k4o2n",
-	"^lam3n",
-	"^mn24j",
-	"^plam3",
-	"^zck35",
-	"^zko34",
-	"^zl3kp",
-	"^zn12n",
-	"^24623168",
-	"^37966926",
-	"^236861982",
-	"^929793776",
-	"^60085811638",
-	"^1913169001452",
-	"^32993056653417",
-	"^3305336302107891869",
-	"^main_file_cache.",
+	std::mutex idleLock;
+	std::condition_variable idleWake;
+	std::exception_ptr error;
+};
 
-	"\\.jag$",
+ParallelScanner::ParallelScanner(int jobs, int deviceJobs, ArchiveWriter &archive, int verbose) : archive(archive), deviceJobs(deviceJobs), verbose(verbose), queues(jobs)
+{
+}
 
-	"^loader.*\\.(jar|cab|zip)$",
-	"^mapview.*\\.(jar|cab|zip)$",
-	"^runescape.*\\.(jar|cab|zip)$",
-	"^loginapplet.*\\.(jar|cab|zip)$",
-	"^jag.*\\.dll$",
-	"^(entity|land|maps|sounds).*\\.mem$",
-	
-	"mudclient",
-	"\\.jag-",
-	"\\.mem-",
-};
+void ParallelScanner::scan(const std::vector<std::filesystem::path> &sources)
+{
+	std::vector<Dir> roots;
+	std::vector<std::string> disks;
+	for(auto &source : sources)
+	{
+		int fd = open(source.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		struct stat statbuf;
+		if(fd == -1 || 0 != fstat(fd, &statbuf))
+		{
+			fprintf(stderr, "Error scanning directory %s: %s\n", source.c_str(), strerror(errno));
+			Stats::add(Stats::Errors);
+			if(fd != -1)
+			{
+				close(fd);
+			}
+			continue;
+		}
+		std::string disk = diskOf(statbuf.st_dev);
+		size_t index = std::find(disks.begin(), disks.end(), disk) - disks.begin();
+		if(index == disks.size())
+		{
+			disks.push_back(disk);
+		}
+		printIfVerbose(verbose, "Search path %s is on %s\n", source.c_str(), disk.c_str());
+		roots.push_back({source, holdDirectory(fd), RootDir, statbuf, 0, index});
+	}
+	if(roots.empty())
+	{
+		return;
+	}
+
+	busy = std::vector<std::atomic<int>>(disks.size());
+	for(auto &queue : queues)
+	{
+		queue.dirs.resize(disks.size());
+	}
+	for(size_t i = 0; i < roots.size(); i++)
+	{
+		push(i % queues.size(), roots[i]);
+	}
 
-std::vector<std::regex> cacheRegexes;
+	std::vector<std::thread> workers;
+	for(size_t i = 0; i < queues.size(); i++)
+	{
+		workers.emplace_back(&ParallelScanner::run, this, i);
+	}
+	for(auto &worker : workers)
+	{
+		worker.join();
+	}
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+}
 
-std::vector<std::string> maskPaths;
-std::vector<std::regex> maskPathRegexes;
+void ParallelScanner::push(size_t self, const Dir &dir)
+{
+	pending++;
+	{
+		std::lock_guard<std::mutex> guard(queues[self].lock);
+		queues[self].dirs[dir.disk].push_back(dir);
+	}
+	idleWake.notify_one();
+}
 
-// Return true if any regex matches the target string
-bool searchRegexes(const std::string &target, const std::vector<std::regex> &regexes)
+// Take a directory on a disk with a worker to spare, counting this worker as
+// busy on it
+bool ParallelScanner::pop(size_t self, Dir &dir)
 {
-	bool result = false;
-	for(auto &regex : regexes)
+	for(size_t i = 0; i < busy.size(); i++)
 	{
-		std::smatch results;
-		if(std::regex_search(target, results, regex))
+		size_t disk = (self + i) % busy.size();
+		if(++busy[disk] <= deviceJobs && take(self, disk, dir))
 		{
-			result = true;
-			break;
+			return true;
 		}
+		busy[disk]--;
 	}
-	return result;
+	return false;
 }
 
-bool isCacheDir(const std::filesystem::path &path, [[maybe_unused]]int verbose)
+bool ParallelScanner::take(size_t self, size_t disk, Dir &dir)
 {
-	bool isCache = searchRegexes(path.filename().string(), cacheDirRegexes);
-	if(!isCache)
 	{
-		if(searchRegexes(path.filename().string(), parentedCacheDirRegexes) &&
-		   path.has_parent_path() &&
-		   searchRegexes(path.parent_path().filename().string(), cacheDirParentRegexes))
+		std::lock_guard<std::mutex> guard(queues[self].lock);
+		std::deque<Dir> &own = queues[self].dirs[disk];
+		if(!own.empty())
 		{
-			isCache = true;
+			dir = std::move(own.back());
+			own.pop_back();
+			return true;
 		}
 	}
-	return isCache;
+	for(size_t i = 1; i < queues.size(); i++)
+	{
+		WorkQueue &victim = queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		std::deque<Dir> &dirs = victim.dirs[disk];
+		if(!dirs.empty())
+		{
+			dir = std::move(dirs.front());
+			dirs.pop_front();
+			return true;
+		}
+	}
+	return false;
 }
 
-// Add a file to the tarball
-//
-// "prefix" is a prefix to be added to the filename in the tarball
-void addFileToTar(const std::filesystem::path &source, const std::string &prefix, FILE *outfile, [[maybe_unused]]int verbose)
+void ParallelScanner::run(size_t self)
 {
-	unsigned char buffer[512];
-	memset(buffer, 0, sizeof(buffer));
-	
-	struct stat statbuf;
-	if(0 == stat(source.c_str(), &statbuf))
-	{
-		std::string tarFilename = prefix + "/" + source.filename().string();
-		memcpy(buffer, tarFilename.data(), tarFilename.length());
-		memcpy(buffer+100, "0000644", 8);
-		memcpy(buffer+108, "0001750", 8);
-		memcpy(buffer+116, "0001750", 8);
-		sprintf((char *)(buffer+124), "%011lo", statbuf.st_size);
-		sprintf((char *)(buffer+136), "%011lo", statbuf.st_mtime);
-		memset(buffer+148, ' ', 8);
-		memcpy(buffer+257, "ustar", 6);
-		memcpy(buffer+263, "00", 2);	// The "2" is correct: this field is not null-terminated
-		memcpy(buffer+265, "user", 5);
-		memcpy(buffer+297, "user", 5);
-		
-		int checksum = 0;
-		for(int i = 0; i < 512; i++)
+	Dir dir;
+	DirListing listing;	// Reused for every directory this worker reads
+	while(!failed)
+	{
+		if(!pop(self, dir))
 		{
-			checksum += buffer[i];
+			if(pending == 0)
+			{
+				break;
+			}
+			// Someone is still scanning and may yet produce more work.
+			// The timeout covers a wakeup sent before we started waiting.
+			std::unique_lock<std::mutex> guard(idleLock);
+			idleWake.wait_for(guard, std::chrono::milliseconds(1));
+			continue;
 		}
-		sprintf((char *)(buffer+148), "%07o", checksum);
-		
-		FILE *infile = fopen(source.c_str(), "r");
-		if(infile)
+
+		try
 		{
-			if(fwrite(buffer, 512, 1, outfile) != 1)
+			bool held = dir.fd != -1;
+			int fd = held ? dir.fd : open(dir.path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+			if(fd == -1)
 			{
-				fprintf(stderr, "Write error %s when adding to archive\n", strerror(errno));
-				throw std::runtime_error("Error writing to output file");
+				fprintf(stderr, "Error scanning directory %s: %s\n", dir.path.c_str(), strerror(errno));
+				Stats::add(Stats::Errors);
 			}
-			
-			while(!feof(infile))
+			else
 			{
-				memset(buffer, 0, sizeof(buffer));
-				int bytesRead = 0;
-				bytesRead = fread(buffer, 1, 512, infile);
-				if(bytesRead < 512 && !feof(infile))
-				{
-					fprintf(stderr, "Read error %s for file %s when adding to archive\n", strerror(errno), source.c_str());
-					throw std::runtime_error("Error reading input file");
-				}
-				if(bytesRead > 0)
+				if(readDirectory(dir.path, fd, dir.kind, dir.statbuf, listing, archive, verbose) && dir.depth != gMaxDepth)
 				{
-					if(fwrite(buffer, 512, 1, outfile) != 1) // This is correct: the Tar file format consists of null-padded 512-byte blocks, so a short read still needs a full-block write
+					size_t next = 0;
+					Subdirectory child;
+					while(nextSubdirectory(dir.path, fd, dir.statbuf.st_dev, listing.entries, next, verbose, child))
 					{
-						fprintf(stderr, "Write error %s when adding to archive\n", strerror(errno));
-						throw std::runtime_error("Error writing to output file");
+						push(self, {std::move(child.path), holdDirectory(child.fd), child.kind, child.statbuf, dir.depth + 1, dir.disk});
 					}
 				}
+				if(held)
+				{
+					releaseDirectory(fd);
+				}
+				else
+				{
+					close(fd);
+				}
 			}
-			fclose(infile);
-			if(fflush(outfile) != 0)
+		}
+		catch(std::exception &e)
+		{
+			std::lock_guard<std::mutex> guard(idleLock);
+			if(!error)
 			{
-				fprintf(stderr, "Error %s flushing buffer to archive\n", strerror(errno));
-				throw std::runtime_error("Error writing to output file");
+				error = std::current_exception();
 			}
+			failed = true;
 		}
-		else
+		busy[dir.disk]--;
+		if(--pending == 0)
 		{
-			fprintf(stderr, "Open error %s for file %s when adding to archive\n", strerror(errno), source.c_str());
+			idleWake.notify_all();
+		}
+		else if(deviceJobs < (int)queues.size())
+		{
+			// Someone may be waiting for this disk
+			idleWake.notify_one();
 		}
-	}
-	else
-	{
-		fprintf(stderr, "Stat error %s for file %s when adding to archive\n", strerror(errno), source.c_str());
 	}
 }
 
-std::string makePrefix(const std::filesystem::path &path)
+// One line of a manifest written by --manifest
+struct ManifestEntry
 {
-	char prefix[70];
-	std::string folder = path.filename().string();
-	if(searchRegexes(folder, maskPathRegexes))
+	std::string name;
+	std::string source;
+};
+
+// Read a JSON string starting at line[pos], which must be the opening quote.
+// Understands everything appendJsonString() writes, and the other escapes
+// too in case the manifest was edited by hand.
+bool parseJsonString(const std::string &line, size_t &pos, std::string &value)
+{
+	value.clear();
+	if(pos >= line.length() || line[pos] != '"')
 	{
-		folder = "folder";
+		return false;
 	}
-	
-	if(path.has_parent_path())
+	for(pos++; pos < line.length(); pos++)
 	{
-		std::string parent = path.parent_path().filename();
-		if(searchRegexes(parent, maskPathRegexes))
+		char c = line[pos];
+		if(c == '"')
 		{
-			parent = "folder";
+			pos++;
+			return true;
+		}
+		if(c != '\\')
+		{
+			value += c;
+			continue;
+		}
+		if(++pos >= line.length())
+		{
+			return false;
+		}
+		switch(line[pos])
+		{
+		case 'b': value += '\b'; break;
+		case 'f': value += '\f'; break;
+		case 'n': value += '\n'; break;
+		case 'r': value += '\r'; break;
+		case 't': value += '\t'; break;
+		case 'u':
+		{
+			if(pos + 4 >= line.length())
+			{
+				return false;
+			}
+			unsigned code = strtoul(line.substr(pos + 1, 4).c_str(), nullptr, 16);
+			pos += 4;
+			// Names are bytes, so only what we'd have escaped comes
+			// back as a single byte; anything else is UTF-8
+			if(code < 0x80)
+			{
+				value += (char)code;
+			}
+			else if(code < 0x800)
+			{
+				value += (char)(0xc0 | (code >> 6));
+				value += (char)(0x80 | (code & 0x3f));
+			}
+			else
+			{
+				value += (char)(0xe0 | (code >> 12));
+				value += (char)(0x80 | ((code >> 6) & 0x3f));
+				value += (char)(0x80 | (code & 0x3f));
+			}
+			break;
+		}
+		default: value += line[pos]; break;
 		}
-		snprintf(prefix, sizeof(prefix), "dir%07d/%s/%s", gDirCounter, parent.c_str(), folder.c_str());
 	}
-	else
+	return false;
+}
+
+// Whether a name from a manifest is one the scan could have given a file: a
+// relative path that fits the tar header's name field, with no empty, "."
+// or ".." components that would put it somewhere else when extracted
+bool validManifestName(const std::string &name)
+{
+	if(name.empty() || name.length() > 100)
 	{
-		snprintf(prefix, sizeof(prefix), "dir%07d/%s", gDirCounter, folder.c_str());
+		return false;
+	}
+	size_t start = 0;
+	while(true)
+	{
+		size_t end = name.find('/', start);
+		std::string_view component = std::string_view(name).substr(start, end == std::string::npos ? std::string::npos : end - start);
+		if(component.empty() || component == "." || component == "..")
+		{
+			return false;
+		}
+		if(end == std::string::npos)
+		{
+			return true;
+		}
+		start = end + 1;
 	}
-	return prefix;
 }
 
-// Add the contents of a cache directory without recursing.  I don't know if
-// the non-recursion is important or not, but it's how the Windows finder works.
-void addCacheDir(const std::filesystem::path &source, FILE *outfile, int verbose)
+// Pick the name and source out of a manifest line.  Other fields are skipped;
+// the file's current size and mtime are what go in the archive.
+bool parseManifestLine(const std::string &line, ManifestEntry &entry)
 {
-	gDirCounter++;
-	std::string prefix = makePrefix(source);
-	try
+	size_t pos = line.find_first_not_of(" \t");
+	if(pos == std::string::npos || line[pos] != '{')
 	{
-		for(auto const &item : std::filesystem::directory_iterator(source, std::filesystem::directory_options::skip_permission_denied))
+		return false;
+	}
+	pos++;
+	std::string key, value;
+	while(true)
+	{
+		pos = line.find_first_not_of(" \t", pos);
+		if(!parseJsonString(line, pos, key))
+		{
+			return false;
+		}
+		pos = line.find_first_not_of(" \t", pos);
+		if(pos == std::string::npos || line[pos] != ':')
 		{
-			try
+			return false;
+		}
+		pos = line.find_first_not_of(" \t", pos + 1);
+		if(pos != std::string::npos && line[pos] == '"')
+		{
+			if(!parseJsonString(line, pos, value))
 			{
-				if(item.is_regular_file())
-				{
-					printf("Adding file %s to archive\n", item.path().c_str());
-					addFileToTar(item.path(), prefix, outfile, verbose);
-				}
+				return false;
 			}
-			catch(std::filesystem::filesystem_error &e)
+			if(key == "name")
 			{
-				fprintf(stderr, "Error processing cache file %s: %s\n", e.path1().c_str(), e.what());
+				entry.name = value;
 			}
+			else if(key == "source")
+			{
+				entry.source = value;
+			}
+		}
+		else
+		{
+			// A number, which we don't need
+			pos = line.find_first_of(",}", pos);
+		}
+		pos = line.find_first_not_of(" \t", pos);
+		if(pos == std::string::npos)
+		{
+			return false;
+		}
+		if(line[pos] == '}')
+		{
+			return !entry.name.empty() && !entry.source.empty() && entry.name.find('/') != std::string::npos;
+		}
+		if(line[pos] != ',')
+		{
+			return false;
 		}
+		pos++;
+	}
+}
+
+// Where a file's data starts on its disk, from FIEMAP.  Returns false if the
+// filesystem can't say, or the file has no data yet.
+bool physicalOffset(const std::filesystem::path &source, uint64_t &offset)
+{
+	int fd = open(source.c_str(), O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+	{
+		return false;
 	}
-	catch(std::filesystem::filesystem_error &e)
+	alignas(struct fiemap) unsigned char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+	struct fiemap *map = (struct fiemap *)request;
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = 1;
+	bool mapped = 0 == ioctl(fd, FS_IOC_FIEMAP, map) && map->fm_mapped_extents == 1 && !(map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN);
+	close(fd);
+	if(mapped)
 	{
-		fprintf(stderr, "Error processing cache directory %s: %s\n", e.path1().c_str(), e.what());
+		offset = map->fm_extents[0].fe_physical;
 	}
+	return mapped;
 }
 
-// Scan a directory for cache-named files.  If any are found, add to the
-// tarball.
-void addCacheFiles(const std::filesystem::path &source, FILE *outfile, int verbose)
+// Archive the files listed in a manifest under the names it gives them, so
+// the archive has the same entries and dirNNNNNNN prefixes as the run that
+// wrote the manifest.  The files are read in the order they lie on disk,
+// sorted by their first extent where FIEMAP works and by inode number
+// otherwise, which on a spinning disk is a far shorter seek than going
+// directory by directory.
+void archiveManifest(const std::string &filename, ArchiveWriter &archive, int verbose)
 {
-	bool foundCacheFile = false;
-	std::string prefix;
-	try
+	FILE *file = fopen(filename.c_str(), "r");
+	if(!file)
+	{
+		fprintf(stderr, "Error %s opening manifest %s\n", strerror(errno), filename.c_str());
+		throw std::runtime_error("Failed to open manifest");
+	}
+
+	struct PlannedFile
 	{
-		for(auto const &item : std::filesystem::directory_iterator(source, std::filesystem::directory_options::skip_permission_denied))
+		dev_t dev;
+		bool mapped;		// Whether "position" is a disk offset or an inode number
+		uint64_t position;
+		ManifestEntry entry;
+		struct stat statbuf;
+	};
+	std::vector<PlannedFile> plan;
+
+	// getline() so that paths of any length come through
+	char *buffer = nullptr;
+	size_t bufferSize = 0;
+	ssize_t length;
+	unsigned lineNumber = 0;
+	while((length = getline(&buffer, &bufferSize, file)) != -1)
+	{
+		lineNumber++;
+		std::string line(buffer, length);
+		while(!line.empty() && (line.back() == '\n' || line.back() == '\r'))
 		{
-			try
-			{
-				if(item.is_symlink())
-				{
-					continue;
-				}
-				if(item.is_regular_file() && searchRegexes(item.path().filename().string(), cacheRegexes))
-				{
-					printIfVerbose(verbose, "Cache file match: %s\n", item.path().c_str());
-					printf("Adding file %s to archive\n", item.path().c_str());
-					if(!foundCacheFile)
-					{
-						gDirCounter++;
-						foundCacheFile = true;
-						prefix = makePrefix(source);
-					}
-					addFileToTar(item.path(), prefix, outfile, verbose);
-				}
-			}
-			catch(std::filesystem::filesystem_error &e)
-			{
-				fprintf(stderr, "Error processing file %s: %s\n", e.path1().c_str(), e.what());
-			}
+			line.pop_back();
+		}
+		if(line.empty())
+		{
+			continue;
+		}
+		PlannedFile planned{};
+		if(!parseManifestLine(line, planned.entry))
+		{
+			fprintf(stderr, "Skipping unreadable line %u of manifest %s\n", lineNumber, filename.c_str());
+			Stats::add(Stats::Errors);
+			continue;
+		}
+		if(!validManifestName(planned.entry.name))
+		{
+			fprintf(stderr, "Error: skipping line %u of manifest %s, whose name %s is too long or not a plain relative path\n", lineNumber, filename.c_str(), planned.entry.name.c_str());
+			Stats::add(Stats::Errors);
+			continue;
+		}
+		// Files in cache directories may be symlinks, which the scan
+		// followed, so follow them here too
+		std::filesystem::path source(planned.entry.source);
+		if(0 != stat(source.c_str(), &planned.statbuf))
+		{
+			fprintf(stderr, "Stat error %s for file %s when adding to archive\n", strerror(errno), source.c_str());
+			Stats::add(Stats::Errors);
+			continue;
+		}
+		if(!S_ISREG(planned.statbuf.st_mode))
+		{
+			fprintf(stderr, "Skipping %s, which is no longer a regular file\n", source.c_str());
+			continue;
+		}
+		planned.dev = planned.statbuf.st_dev;
+		planned.mapped = physicalOffset(source, planned.position);
+		if(!planned.mapped)
+		{
+			planned.position = planned.statbuf.st_ino;
+		}
+		plan.push_back(std::move(planned));
+	}
+	bool readFailed = ferror(file);
+	free(buffer);
+	fclose(file);
+	if(readFailed)
+	{
+		fprintf(stderr, "Error reading manifest %s\n", filename.c_str());
+		throw std::runtime_error("Failed to read manifest");
+	}
+
+	std::sort(plan.begin(), plan.end(), [](const PlannedFile &a, const PlannedFile &b)
+	{
+		if(a.dev != b.dev)
+		{
+			return a.dev < b.dev;
+		}
+		if(a.mapped != b.mapped)
+		{
+			return a.mapped;
 		}
+		return a.position < b.position;
+	});
+
+	// Directories are scattered over the disk, so each is only ended
+	// after the last of its files
+	std::unordered_map<std::string, size_t> lastFiles;
+	for(size_t i = 0; i < plan.size(); i++)
+	{
+		lastFiles[plan[i].entry.name.substr(0, plan[i].entry.name.rfind('/'))] = i;
 	}
-	catch(std::filesystem::filesystem_error &e)
+	for(size_t i = 0; i < plan.size(); i++)
 	{
-		fprintf(stderr, "Error processing directory %s: %s\n", e.path1().c_str(), e.what());
+		PlannedFile &planned = plan[i];
+		std::filesystem::path source(planned.entry.source);
+		printIfVerbose(verbose, "Archiving %s as %s\n", source.c_str(), planned.entry.name.c_str());
+		printf("Adding file %s to archive\n", source.c_str());
+		std::string prefix = planned.entry.name.substr(0, planned.entry.name.rfind('/'));
+		const std::string &interned = archive.intern(prefix);
+		archive.add(source, planned.statbuf, interned);
+		if(lastFiles[prefix] == i)
+		{
+			archive.endDirectory(interned);
+		}
 	}
 }
 
-void scanPath(const std::filesystem::path &source, FILE *outfile, int verbose)
+// The --progress line, printed to stderr every few seconds from a thread of
+// its own while the archive is built, and a summary once it is done.  Rates
+// are over the last interval.  The ETA compares the entries examined with
+// the inodes in use on the search path's filesystem: the scan doesn't stat
+// the files it passes over, so the space they use can't be counted off, but
+// every inode is reached through at least one entry.
+class Progress
 {
-	printIfVerbose(verbose, "Scanning %s\n", source.c_str());
-	try
+public:
+	Progress(const std::vector<std::filesystem::path> &sources, int interval);
+	~Progress();
+
+	// Stop printing progress lines and print the summary
+	void finish();
+
+private:
+	void run();
+	void print(const Stats::Totals &now, const Stats::Totals &last, double elapsed, double seconds);
+
+	int interval;
+	uint64_t usedInodes = 0;	// Zero where the filesystem doesn't count them
+	std::chrono::steady_clock::time_point start;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping = false;
+	std::thread thread;
+};
+
+Progress::Progress(const std::vector<std::filesystem::path> &sources, int interval) : interval(interval), start(std::chrono::steady_clock::now())
+{
+	// Count each filesystem once, however many search paths are on it
+	std::set<dev_t> filesystems;
+	for(auto &source : sources)
 	{
-		for(auto const &dir : std::filesystem::directory_iterator(source, std::filesystem::directory_options::skip_permission_denied))
+		struct stat statbuf;
+		struct statfs info;
+		if(0 != stat(source.c_str(), &statbuf) || 0 != statfs(source.c_str(), &info) || info.f_files <= info.f_ffree)
 		{
-			try
-			{
-				if(dir.is_directory())
-				{
-					if(dir.is_symlink())
-					{
-						printIfVerbose(verbose, "Skipping directory symlink %s\n", dir.path().c_str());
-						continue;
-					}
-					else if(searchRegexes(dir.path().filename().string(), cacheExcludeRegexes))
-					{
-						printIfVerbose(verbose, "Excluding directory %s\n", dir.path().c_str());
-						continue;
-					}
-					else if(isCacheDir(dir.path(), verbose))
-					{
-						printIfVerbose(verbose, "Cache dir found: %s\n", dir.path().c_str());
-						addCacheDir(dir.path(), outfile, verbose);
-					}
-					else
-					{
-						addCacheFiles(dir.path(), outfile, verbose);
-					}
-					scanPath(dir.path(), outfile, verbose);
-				}
-			}
-			catch(std::filesystem::filesystem_error &e)
-			{
-				fprintf(stderr, "Error processing entry %s: %s\n", e.path1().c_str(), e.what());
-			}
+			usedInodes = 0;
+			break;
 		}
+		if(filesystems.insert(statbuf.st_dev).second)
+		{
+			usedInodes += info.f_files - info.f_ffree;
+		}
+	}
+	thread = std::thread(&Progress::run, this);
+}
+
+Progress::~Progress()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	if(thread.joinable())
+	{
+		thread.join();
+	}
+}
+
+// "seconds" as h:mm:ss
+std::string formatDuration(double seconds)
+{
+	char text[32];
+	unsigned long total = seconds;
+	snprintf(text, sizeof(text), "%lu:%02lu:%02lu", total / 3600, total / 60 % 60, total % 60);
+	return text;
+}
+
+double megabytes(uint64_t bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+void Progress::run()
+{
+	Stats::Totals last = Stats::totals();
+	auto lastTime = start;
+	std::unique_lock<std::mutex> guard(lock);
+	while(!wake.wait_for(guard, std::chrono::seconds(interval), [this]{ return stopping; }))
+	{
+		Stats::Totals now = Stats::totals();
+		auto nowTime = std::chrono::steady_clock::now();
+		print(now, last, std::chrono::duration<double>(nowTime - start).count(), std::chrono::duration<double>(nowTime - lastTime).count());
+		last = now;
+		lastTime = nowTime;
 	}
-	catch(std::filesystem::filesystem_error &e)
+}
+
+void Progress::print(const Stats::Totals &now, const Stats::Totals &last, double elapsed, double seconds)
+{
+	std::string eta;
+	if(usedInodes && now[Stats::Entries] > 0 && now[Stats::Entries] < usedInodes)
+	{
+		double done = (double)now[Stats::Entries] / usedInodes;
+		char text[64];
+		snprintf(text, sizeof(text), ", %.0f%% ETA %s", done * 100, formatDuration(elapsed / done - elapsed).c_str());
+		eta = text;
+	}
+	fprintf(stderr, "Progress: %llu dirs (%.0f/s), %llu entries, %llu matches, %.1f MB read (%.1f MB/s), %.1f MB written, %llu errors%s\n",
+		(unsigned long long)now[Stats::Dirs], (now[Stats::Dirs] - last[Stats::Dirs]) / seconds,
+		(unsigned long long)now[Stats::Entries], (unsigned long long)now[Stats::Matches],
+		megabytes(now[Stats::BytesRead]), megabytes(now[Stats::BytesRead] - last[Stats::BytesRead]) / seconds,
+		megabytes(now[Stats::BytesWritten]), (unsigned long long)now[Stats::Errors], eta.c_str());
+}
+
+void Progress::finish()
+{
 	{
-		fprintf(stderr, "Error scanning directory %s: %s\n", e.path1().c_str(), e.what());
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
 	}
+	wake.notify_all();
+	thread.join();
+
+	Stats::Totals totals = Stats::totals();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fprintf(stderr, "Finished in %s: %llu dirs, %llu entries, %llu matches, %.1f MB read (%.1f MB/s), %.1f MB written, %llu errors\n",
+		formatDuration(elapsed).c_str(), (unsigned long long)totals[Stats::Dirs], (unsigned long long)totals[Stats::Entries],
+		(unsigned long long)totals[Stats::Matches], megabytes(totals[Stats::BytesRead]),
+		elapsed > 0 ? megabytes(totals[Stats::BytesRead]) / elapsed : 0.0,
+		megabytes(totals[Stats::BytesWritten]), (unsigned long long)totals[Stats::Errors]);
+}
+
+PatternMatcher CompileRegexes(const std::vector<std::string> &patterns)
+{
+	return PatternMatcher(patterns);
 }
 
-std::vector<std::regex> CompileRegexes(const std::vector<std::string> &patterns)
+// Parse an option's value, which must be a whole number from 0 to INT_MAX
+// with nothing before or after it.  Returns false if it isn't, leaving
+// "value" alone.
+bool parseCount(const char *text, int &value)
 {
-	std::vector<std::regex> result;
-	for(auto pattern : patterns)
+	if(!isdigit((unsigned char)text[0]))
 	{
-		std::regex regex(pattern, std::regex::ECMAScript|std::regex::icase|std::regex::nosubs|std::regex::optimize);
-		result.push_back(regex);
+		return false;
 	}
-	return result;
+	char *end;
+	errno = 0;
+	long parsed = strtol(text, &end, 10);
+	if(*end != '\0' || errno == ERANGE || parsed > INT_MAX)
+	{
+		return false;
+	}
+	value = parsed;
+	return true;
 }
 
+// The benchmarks in bench/ include this file for its internals and bring
+// their own main()
+#ifndef RS_CACHE_FINDER_NO_MAIN
 int main(int argc, char *argv[])
 {
 	int help = 0;
 	int verbose = 0;
+	int jobs = 1;
+	int deviceJobs = 0;
+	int deterministic = 0;
+	int directIO = 0;
+	OutputFile::FlushPolicy flushPolicy = OutputFile::FlushEachFile;
+	off_t syncInterval = 0;
+	Compressor::Format compression = Compressor::None;
+	int compressLevel = -1;
+	int compressThreads = std::max(1u, std::thread::hardware_concurrency());
+	int readAheadDepth = 0;
+	int dedup = 0;
+	std::string stateFile;
+	std::string manifestFile;
+	std::string fromManifest;
+	int progressInterval = 0;
+	std::string profileFile;
+	off_t splitSize = 0;
+	int volumes = 0;
+	std::vector<std::filesystem::path> volumeDirs;
 	std::vector<std::string> extraExcludes;
+	int checkpointInterval = 0;
+	int resume = 0;
 	
 	static struct option long_options[] = {
 		{"verbose",	no_argument,		&verbose, 1},
 		{"help",	no_argument,		&help, 1},
 		{"exclude",	required_argument,	0, 0},
 		{"mask-path",	required_argument,	0, 0},
+		{"jobs",	required_argument,	0, 0},
+		{"deterministic",	no_argument,	&deterministic, 1},
+		{"direct-io",	no_argument,		&directIO, 1},
+		{"flush",	required_argument,	0, 0},
+		{"compress",	required_argument,	0, 0},
+		{"compress-level",	required_argument,	0, 0},
+		{"compress-threads",	required_argument,	0, 0},
+		{"read-ahead",	required_argument,	0, 0},
+		{"max-depth",	required_argument,	0, 0},
+		{"max-open-dirs",	required_argument,	0, 0},
+		{"prune",	required_argument,	0, 0},
+		{"one-file-system",	no_argument,	&gOneFileSystem, 1},
+		{"state-file",	required_argument,	0, 0},
+		{"delta",	no_argument,		&gDelta, 1},
+		{"dedup",	no_argument,		&dedup, 1},
+		{"manifest",	required_argument,	0, 0},
+		{"dry-run",	no_argument,		&gDryRun, 1},
+		{"from-manifest",	required_argument,	0, 0},
+		{"progress",	optional_argument,	0, 0},
+		{"profile",	required_argument,	0, 0},
+		{"device-jobs",	required_argument,	0, 0},
+		{"split-size",	required_argument,	0, 0},
+		{"volumes",	required_argument,	0, 0},
+		{"volume-dir",	required_argument,	0, 0},
+		{"prefetch",	optional_argument,	0, 0},
+		{"checkpoint",	optional_argument,	0, 0},
+		{"resume",	no_argument,		&resume, 1},
 		{0,		0,			0, 0}
 	};
 	
@@ -432,6 +7730,180 @@ int main(int argc, char *argv[])
 		{
 			maskPaths.push_back(optarg);
 		}
+		else if(longIndex == 4)
+		{
+			if(!parseCount(optarg, jobs) || jobs < 1)
+			{
+				showhelp(argv[0], "--jobs must be a number of at least 1");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 7)
+		{
+			int megabytes = 0;
+			if(0 == strcmp(optarg, "safe"))
+			{
+				flushPolicy = OutputFile::FlushEachFile;
+			}
+			else if(0 == strcmp(optarg, "never"))
+			{
+				flushPolicy = OutputFile::FlushNever;
+			}
+			else if(0 == strcmp(optarg, "end"))
+			{
+				flushPolicy = OutputFile::FlushAtEnd;
+			}
+			else if(parseCount(optarg, megabytes) && megabytes > 0)
+			{
+				flushPolicy = OutputFile::FlushPeriodic;
+				syncInterval = (off_t)megabytes * 1024 * 1024;
+			}
+			else
+			{
+				showhelp(argv[0], "--flush must be safe, never, end, or a number of megabytes");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 8)
+		{
+			if(0 == strcmp(optarg, "gzip"))
+			{
+				compression = Compressor::Gzip;
+			}
+			else if(0 == strcmp(optarg, "zstd"))
+			{
+#ifdef HAVE_ZSTD
+				compression = Compressor::Zstd;
+#else
+				showhelp(argv[0], "This build does not include zstd support");
+				return EXIT_FAILURE;
+#endif
+			}
+			else
+			{
+				showhelp(argv[0], "--compress must be gzip or zstd");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 9)
+		{
+			// -1 is left to mean "not given", so a level is never negative
+			if(!parseCount(optarg, compressLevel))
+			{
+				showhelp(argv[0], "--compress-level must be a number");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 10)
+		{
+			if(!parseCount(optarg, compressThreads) || compressThreads < 1)
+			{
+				showhelp(argv[0], "--compress-threads must be a number of at least 1");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 11)
+		{
+			if(!parseCount(optarg, readAheadDepth))
+			{
+				showhelp(argv[0], "--read-ahead must be a number of files");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 12)
+		{
+			if(!parseCount(optarg, gMaxDepth))
+			{
+				showhelp(argv[0], "--max-depth must be a number of levels");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 13)
+		{
+			if(!parseCount(optarg, gMaxOpenDirs))
+			{
+				showhelp(argv[0], "--max-open-dirs must be a number of directories");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 14)
+		{
+			pruneDirs.push_back(optarg);
+		}
+		else if(longIndex == 16)
+		{
+			stateFile = optarg;
+		}
+		else if(longIndex == 19)
+		{
+			manifestFile = optarg;
+		}
+		else if(longIndex == 21)
+		{
+			fromManifest = optarg;
+		}
+		else if(longIndex == 22)
+		{
+			progressInterval = 5;
+			if(optarg && (!parseCount(optarg, progressInterval) || progressInterval < 1))
+			{
+				showhelp(argv[0], "--progress must be a number of at least 1 second");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 23)
+		{
+			profileFile = optarg;
+		}
+		else if(longIndex == 24)
+		{
+			if(!parseCount(optarg, deviceJobs) || deviceJobs < 1)
+			{
+				showhelp(argv[0], "--device-jobs must be a number of at least 1");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 25)
+		{
+			int megabytes;
+			if(!parseCount(optarg, megabytes) || megabytes < 1)
+			{
+				showhelp(argv[0], "--split-size must be a number of at least 1 megabyte");
+				return EXIT_FAILURE;
+			}
+			splitSize = (off_t)megabytes * 1024 * 1024;
+		}
+		else if(longIndex == 26)
+		{
+			if(!parseCount(optarg, volumes) || volumes < 1)
+			{
+				showhelp(argv[0], "--volumes must be a number of at least 1");
+				return EXIT_FAILURE;
+			}
+		}
+		else if(longIndex == 27)
+		{
+			volumeDirs.push_back(optarg);
+		}
+		else if(longIndex == 28)
+		{
+			int megabytes = 64;
+			if(optarg && (!parseCount(optarg, megabytes) || megabytes < 1))
+			{
+				showhelp(argv[0], "--prefetch must be a number of at least 1 megabyte");
+				return EXIT_FAILURE;
+			}
+			gPrefetchBytes = (uint64_t)megabytes * 1024 * 1024;
+		}
+		else if(longIndex == 29)
+		{
+			checkpointInterval = 60;
+			if(optarg && (!parseCount(optarg, checkpointInterval) || checkpointInterval < 1))
+			{
+				showhelp(argv[0], "--checkpoint must be a number of at least 1 second");
+				return EXIT_FAILURE;
+			}
+		}
 	}
 	
 	if(help)
@@ -439,60 +7911,342 @@ int main(int argc, char *argv[])
 		showhelp(argv[0]);
 		return EXIT_SUCCESS;
 	}
-	if(optind == argc)
+	if(compressLevel == -1)
+	{
+		compressLevel = (compression == Compressor::Zstd) ? 3 : 6;
+	}
+	else if(compression == Compressor::Gzip && (compressLevel < 0 || compressLevel > 9))
+	{
+		showhelp(argv[0], "--compress-level must be between 0 and 9 for gzip");
+		return EXIT_FAILURE;
+	}
+	else if(compression == Compressor::Zstd && (compressLevel < 1 || compressLevel > 19))
+	{
+		showhelp(argv[0], "--compress-level must be between 1 and 19 for zstd");
+		return EXIT_FAILURE;
+	}
+	if(gDelta && stateFile.empty())
+	{
+		showhelp(argv[0], "--delta needs --state-file");
+		return EXIT_FAILURE;
+	}
+	// --from-manifest takes the place of the search path
+	bool scanning = fromManifest.empty();
+	if(!scanning && (gDryRun || deterministic || !stateFile.empty()))
+	{
+		showhelp(argv[0], "--from-manifest can't be used with --dry-run, --deterministic or --state-file");
+		return EXIT_FAILURE;
+	}
+	if(optind == argc && scanning)
 	{
 		showhelp(argv[0], "No search path provided");
 		return EXIT_FAILURE;
 	}
-	if(optind == argc - 1)
+	// Every path but the last is searched, or every one with --dry-run,
+	// which doesn't write an archive
+	int outputArg = gDryRun ? argc : argc - 1;
+	if(!gDryRun && outputArg == optind && scanning)
 	{
 		showhelp(argv[0], "No output path provided");
 		return EXIT_FAILURE;
 	}
+	if(!scanning && argc - optind != 1)
+	{
+		showhelp(argv[0], optind == argc ? "No output path provided" : "--from-manifest takes an output path and no search paths");
+		return EXIT_FAILURE;
+	}
+	if(deviceJobs == 0 || deviceJobs > jobs)
+	{
+		deviceJobs = jobs;
+	}
+	bool splitting = splitSize > 0 || volumes > 0;
+	if(splitting && gDryRun)
+	{
+		showhelp(argv[0], "--dry-run doesn't write an archive to split");
+		return EXIT_FAILURE;
+	}
+	if(!volumeDirs.empty() && !splitting)
+	{
+		showhelp(argv[0], "--volume-dir needs --split-size or --volumes");
+		return EXIT_FAILURE;
+	}
+	bool streaming = !gDryRun && isStreamOutput(argv[outputArg]);
+	if(splitting && streaming)
+	{
+		showhelp(argv[0], "--split-size and --volumes write files, not a stream");
+		return EXIT_FAILURE;
+	}
+	if(resume && !checkpointInterval)
+	{
+		checkpointInterval = 60;
+	}
+	if(checkpointInterval && (gDryRun || deterministic || !scanning || splitting || streaming))
+	{
+		showhelp(argv[0], "--checkpoint and --resume need an output file, and can't be used with --dry-run, --deterministic, --from-manifest, --split-size or --volumes");
+		return EXIT_FAILURE;
+	}
 	
-	cacheRegexes = CompileRegexes(cachePatterns);
-	cacheDirRegexes = CompileRegexes(cacheDirs);
-	parentedCacheDirRegexes = CompileRegexes(parentedCacheDirs);
-	cacheDirParentRegexes = CompileRegexes(cacheDirParents);
-	cacheExcludeRegexes = CompileRegexes(cacheExcludeDirs);
-	auto extraExcludeRegexes = CompileRegexes(extraExcludes);
-	cacheExcludeRegexes.insert(cacheExcludeRegexes.end(), extraExcludeRegexes.begin(), extraExcludeRegexes.end());
+	extraExcludes.insert(extraExcludes.begin(), cacheExcludeDirs.begin(), cacheExcludeDirs.end());
+	cacheExcludeRegexes = CompileRegexes(extraExcludes);
 	maskPathRegexes = CompileRegexes(maskPaths);
+	if(!manifestFile.empty())
+	{
+		cacheRules = RuleFinder(patternList(cachePatterns));
+		cacheDirRules = RuleFinder(patternList(cacheDirs));
+		parentedCacheDirRules = RuleFinder(patternList(parentedCacheDirs));
+		cacheDirParentRules = RuleFinder(patternList(cacheDirParents));
+	}
+	
+	// Leave at least half the descriptor limit for the files being archived
+	struct rlimit fileLimit;
+	if(0 == getrlimit(RLIMIT_NOFILE, &fileLimit) && fileLimit.rlim_cur != RLIM_INFINITY)
+	{
+		gMaxOpenDirs = std::min<rlim_t>(gMaxOpenDirs, fileLimit.rlim_cur / 2);
+	}
 	
 	try
 	{
-		std::filesystem::path source(argv[optind]);
-		if(!std::filesystem::exists(source))
+		std::vector<std::filesystem::path> sources;
+		if(scanning)
+		{
+			sources.assign(argv + optind, argv + outputArg);
+		}
+		std::set<std::pair<dev_t, ino_t>> sourceDirs;
+		for(auto &source : sources)
+		{
+			struct stat statbuf;
+			if(!std::filesystem::exists(source))
+			{
+				fprintf(stderr, "Error: Source path %s does not exist\n", source.c_str());
+				return EXIT_FAILURE;
+			}
+			if(!std::filesystem::is_directory(source) || 0 != stat(source.c_str(), &statbuf))
+			{
+				fprintf(stderr, "Error: Source path %s is not a directory\n", source.c_str());
+				return EXIT_FAILURE;
+			}
+			if(!sourceDirs.insert({statbuf.st_dev, statbuf.st_ino}).second)
+			{
+				fprintf(stderr, "Error: Source path %s is given more than once\n", source.c_str());
+				return EXIT_FAILURE;
+			}
+		}
+		for(auto &prune : pruneDirs)
+		{
+			if(prune[0] == '/')
+			{
+				// Spelt the way the scan will build the path to it, under
+				// each search path
+				size_t start = prune.find_first_not_of('/');
+				if(start == std::string::npos)
+				{
+					continue;
+				}
+				std::string relative = prune.substr(start);
+				while(!relative.empty() && relative.back() == '/')
+				{
+					relative.pop_back();
+				}
+				for(auto &source : sources)
+				{
+					prunePaths.insert((source / relative).native());
+				}
+			}
+			else
+			{
+				pruneNames.insert(prune);
+			}
+		}
+		
+		// A fresh run's journal, manifest and profile mustn't exist either,
+		// and are looked for before the archive is created, so that a stale
+		// one doesn't leave an empty archive behind
+		for(const std::string &sideFile : {resume ? std::string() : manifestFile, profileFile, (checkpointInterval && !resume) ? std::string(argv[outputArg]) + ".checkpoint" : std::string()})
 		{
-			fprintf(stderr, "Error: Source path %s does not exist\n", source.c_str());
-			return EXIT_FAILURE;
+			if(!sideFile.empty() && std::filesystem::exists(sideFile))
+			{
+				fprintf(stderr, "Error: %s already exists\n", sideFile.c_str());
+				return EXIT_FAILURE;
+			}
 		}
-		if(!std::filesystem::is_directory(source))
+		
+		int fd;
+		bool createdOutput = false;
+		std::string request;
+		if(gDryRun || splitting)
 		{
-			fprintf(stderr, "Error: Source path %s is not a directory\n", source.c_str());
-			return EXIT_FAILURE;
+			// Nothing is written, or it all goes to the volumes, but the
+			// archive writer still wants an output to not write it to
+			fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
 		}
-		std::filesystem::path dest(argv[optind+1]);
-		FILE *outfile = NULL;
-		if(std::filesystem::exists(dest))
+		else if(streaming)
 		{
-			fprintf(stderr, "Error: Output path %s already exists\n", dest.c_str());
-			return EXIT_FAILURE;
+			if(directIO)
+			{
+				fprintf(stderr, "Warning: %s does not support direct I/O, continuing without it\n", argv[outputArg]);
+				directIO = 0;
+			}
+			fd = openStreamOutput(argv[outputArg], request);
+			if(fd == -1)
+			{
+				return EXIT_FAILURE;
+			}
 		}
 		else
 		{
-			outfile = fopen(dest.c_str(), "w");
-			if(!outfile)
+			std::filesystem::path dest(argv[outputArg]);
+			if(resume && !std::filesystem::exists(dest))
+			{
+				fprintf(stderr, "Error: Output path %s does not exist to resume\n", dest.c_str());
+				return EXIT_FAILURE;
+			}
+			if(!resume && std::filesystem::exists(dest))
+			{
+				fprintf(stderr, "Error: Output path %s already exists\n", dest.c_str());
+				return EXIT_FAILURE;
+			}
+			fd = createOutput(dest, directIO, resume);
+			if(fd == -1)
 			{
-				fprintf(stderr, "Error %s opening output file %s\n", strerror(errno), dest.c_str());
 				return EXIT_FAILURE;
 			}
+			createdOutput = !resume;
+		}
+		ScanState state;
+		if(!stateFile.empty())
+		{
+			// Kinds and listings in the index only hold for the same
+			// roots, and the same rules for what is scanned below them
+			std::string settings;
+			for(auto &list : {std::vector<std::string>(sources.begin(), sources.end()), pruneDirs, extraExcludes})
+			{
+				for(auto &item : list)
+				{
+					settings += item;
+					settings += '\0';
+				}
+				settings += '\n';
+			}
+			settings += std::to_string(gMaxDepth) + (gOneFileSystem ? " one-file-system" : "");
+			state.load(stateFile, settings);
+			gState = &state;
+		}
+		// Loaded after the state file, so that gDirCounter is as the
+		// checkpoint left it
+		std::unique_ptr<Checkpoint> checkpoint;
+		std::unique_ptr<Manifest> manifest;
+		try
+		{
+			if(checkpointInterval)
+			{
+				checkpoint = std::make_unique<Checkpoint>(argv[outputArg], checkpointInterval, resume, compression, !manifestFile.empty());
+				gCheckpoint = checkpoint.get();
+			}
+			if(!manifestFile.empty())
+			{
+				manifest = std::make_unique<Manifest>(manifestFile, resume ? checkpoint->manifestLength() : -1);
+			}
+			if(!profileFile.empty())
+			{
+				Profile::open(profileFile);
+			}
+		}
+		catch(std::exception &)
+		{
+			// Take back what this run created, so that the same command
+			// can be run again once the problem is fixed
+			if(createdOutput)
+			{
+				close(fd);
+				unlink(argv[outputArg]);
+			}
+			if(checkpoint && !resume)
+			{
+				checkpoint->remove();
+			}
+			if(manifest && !resume)
+			{
+				unlink(manifestFile.c_str());
+			}
+			throw;
+		}
+		
+		OutputFile outfile(fd, directIO && !gDryRun && !splitting, flushPolicy, syncInterval);
+		if(!request.empty())
+		{
+			outfile.upload(request);
+		}
+		if(resume)
+		{
+			outfile.resume(checkpoint->archiveLength());
+		}
+		if(!gDryRun && !splitting)
+		{
+			outfile.compress(compression, compressLevel, compressThreads);
+		}
+		
+		std::unique_ptr<Progress> progress;
+		if(progressInterval)
+		{
+			progress = std::make_unique<Progress>(sources, progressInterval);
+		}
+		
+		std::unique_ptr<VolumeSet> volumeSet;
+		if(splitting)
+		{
+			VolumeSet::Settings settings{argv[outputArg], volumeDirs, std::max(volumes, 1), splitSize, directIO, flushPolicy, syncInterval, compression, compressLevel, compressThreads, (unsigned)readAheadDepth, dedup != 0};
+			volumeSet = std::make_unique<VolumeSet>(settings, manifest.get(), verbose);
 		}
 		
-		scanPath(source, outfile, verbose);
+		ArchiveWriter archive(outfile, jobs > 1 && scanning, deterministic, readAheadDepth, dedup, manifest.get(), gDryRun, volumeSet.get(), verbose);
+		if(!scanning)
+		{
+			archiveManifest(fromManifest, archive, verbose);
+		}
+		else if(jobs > 1)
+		{
+			ParallelScanner scanner(jobs, deviceJobs, archive, verbose);
+			scanner.scan(sources);
+		}
+		else
+		{
+			for(auto &source : sources)
+			{
+				scanPath(source, archive, verbose);
+			}
+		}
+		archive.finish();
+		if(volumeSet)
+		{
+			volumeSet->finish();
+		}
+		if(manifest)
+		{
+			manifest->close();
+		}
 		
-		fflush(outfile);
-		fclose(outfile);
+		outfile.close();
+		if(gDryRun)
+		{
+			printf("Found %llu files, %llu bytes\n", (unsigned long long)archive.fileCount(), (unsigned long long)archive.byteCount());
+		}
+		// A dry run's state would claim files were archived that weren't
+		else if(gState)
+		{
+			gState->save(stateFile);
+		}
+		if(checkpoint)
+		{
+			checkpoint->remove();
+		}
+		if(!profileFile.empty())
+		{
+			Profile::write();
+		}
+		if(progress)
+		{
+			progress->finish();
+		}
 	}
 	catch(std::exception &e)
 	{
@@ -501,4 +8255,5 @@ int main(int argc, char *argv[])
 	}
 	
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file